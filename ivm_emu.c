@@ -47,13 +47,13 @@
     gcc -Ofast -DNOOPT     ivm_emu.c  # Disable optimizations
     gcc -Ofast -DHISTOGRAM ivm_emu.c  # Enable insn. pattern histogram
 
- Number of processes for the parallel version:
- * Default: 8
+ Number of threads for the parallel version:
+ * Default: 4
  * if compiled with -DNUM_THREADS=N1, N1 is used instead of the default value
  * if environment variable export NUM_THREADS=N2, N2 is used instead of N1 or default
- * In any case, the parallel version uses at least 2 processes, in general:
-            1 for emulation and (N-1) processes for io
- Note that this number refers to forked processes, although named NUM_THREADS
+ * In any case, the parallel version uses at least 2 threads, in general:
+            1 for emulation and (N-1) threads for io
+   (a pool of threads that write the finished frames)
 */
 
 // Version v2.1.5 compatible with ivm implementation v2.1
@@ -302,8 +302,13 @@
 
 
 // HEADERS
+#define _GNU_SOURCE // fopencookie() (ivm_io_async.h)
 #include <locale.h>
 #include <termios.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 // include emulator header file after defines
 #include "ivm_emu.h"
 
@@ -320,6 +325,52 @@ char* argFile = NULL;
 char* envFile = NULL;
 char* inpDir = NULL;
 char* outDir = NULL;
+int opt_mmap = 0;                      // Map the binary instead of reading it (--mmap)
+char* opt_snapshot = NULL;             // Snapshot file (--snapshot <file>)
+char* opt_restore = NULL;              // Snapshot to resume from (--restore <file>)
+char* opt_recode_cache = NULL;         // Directory of the recode cache (--recode-cache <dir>)
+char* opt_server = NULL;               // Socket of the fork-server mode (--server <socket>)
+int opt_mem_report = 0;                // Report the memory used at exit (--mem-report)
+int opt_png = 0;                       // PNG encoder profile (--png default|fast|store|builtin)
+
+// PNG encoder profiles
+#define PNG_DEFAULT 0  // libpng defaults (zlib level 6, adaptive filtering)
+#define PNG_FAST    1  // libpng, fastest deflate, filter Sub
+#define PNG_STORE   2  // libpng, no compression
+#define PNG_BUILTIN 3  // own single-pass encoder, fastest deflate, filter Sub
+static char *png_profiles[] = {"default", "fast", "store", "builtin"};
+int opt_png_threads = 1;               // Threads compressing each large PNG frame (--png-threads N)
+char* opt_apng = NULL;                 // Frames as one animated PNG (--apng <file>)
+char* opt_bytes_out = NULL;            // Stream of PUT_BYTE instead of .bytes files (--bytes-out <fd|file|->)
+int opt_discard_output = 0;            // Output instructions only pop their operands (--discard-output)
+#define MAX_CHAIN 16
+char* opt_chain[MAX_CHAIN];            // Binaries reading the frames of the stage before (--chain <binary>)
+int opt_num_chain = 0;
+
+// Output instructions that can be discarded
+#define DISCARD_FRAMES 1  // NEW_FRAME, SET_PIXEL, BLIT and ADD_SAMPLE
+#define DISCARD_BYTES  2  // PUT_BYTE
+#define DISCARD_CHARS  4  // PUT_CHAR
+char* opt_video_out = NULL;            // Video stream instead of .png files (--video-out <file|->)
+char* opt_audio_out = NULL;            // Audio stream instead of .wav files (--audio-out <file|->)
+char* opt_wav_out = NULL;              // One WAV file instead of a .wav per frame (--wav-out <file>)
+int opt_prefetch = 1;                  // Input frames decoded ahead (--prefetch N)
+size_t opt_in_cache = 0;               // Memory for decoded input frames (--in-cache <bytes>)
+size_t opt_chain_cache = 0;            // Memory for the frames of the previous stage (--chain-cache <bytes>)
+int opt_video_format = 0;              // Format of the video stream (--video-format y4m|rgb|ppm)
+
+// Video stream formats
+#define VIDEO_Y4M 0
+#define VIDEO_RGB 1
+#define VIDEO_PPM 2
+static char *video_formats[] = {"y4m", "rgb", "ppm"};
+int opt_out_backend = 0;               // Writer of the output files (--out-backend sync|thread|uring)
+
+// Output backends (sequential build)
+#define OUT_SYNC   0  // fopen/fwrite/fclose on the emulator thread
+#define OUT_THREAD 1  // whole files written by a writer thread
+#define OUT_URING  2  // whole files written through io_uring
+static char *out_backends[] = {"sync", "thread", "uring"};
 
 
 #if defined(WITH_IO)
@@ -363,7 +414,8 @@ char *PC;               // Program counter
 char *SP;               // Stack pointer
 char *Mem;              // The memory
 unsigned long MemBytes; // Size of the memory
-void* addr[256];        // Where to go to execute the instruction
+void* volatile addr[256]; // Where to go to execute the instruction
+                          // (volatile: rewritten by the SIGUSR1 handler)
 
 
 long segment_start = 0; // Where to load the bytecode
@@ -400,26 +452,70 @@ unsigned long samples[256];
 
 #ifdef PARALLEL_OUTPUT
 #if !defined(NUM_THREADS)
-    // Default number of processes
+    // Default number of threads
     int maxproc = 4;
 #else
     // defined with -DNUM_THREADS=N at compile time
     int maxproc = NUM_THREADS;
 #endif
-
-int child = 0;
-unsigned int nproc=0;
-int status;
 #endif
 
 
 /*
     Process command line options
 */
+// Options with no short equivalent
+enum long_opts {
+    OPT_MMAP = 256,
+    OPT_SNAPSHOT,
+    OPT_RESTORE,
+    OPT_RECODE_CACHE,
+    OPT_SERVER,
+    OPT_MEM_REPORT,
+    OPT_PNG,
+    OPT_VIDEO_OUT,
+    OPT_VIDEO_FORMAT,
+    OPT_AUDIO_OUT,
+    OPT_WAV_OUT,
+    OPT_PREFETCH,
+    OPT_IN_CACHE,
+    OPT_OUT_BACKEND,
+    OPT_PNG_THREADS,
+    OPT_APNG,
+    OPT_BYTES_OUT,
+    OPT_DISCARD_OUTPUT,
+    OPT_CHAIN,
+    OPT_CHAIN_CACHE,
+};
+
+static struct option long_options[] = {
+    {"mmap", no_argument, NULL, OPT_MMAP},
+    {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+    {"restore", required_argument, NULL, OPT_RESTORE},
+    {"recode-cache", required_argument, NULL, OPT_RECODE_CACHE},
+    {"server", required_argument, NULL, OPT_SERVER},
+    {"mem-report", no_argument, NULL, OPT_MEM_REPORT},
+    {"png", required_argument, NULL, OPT_PNG},
+    {"video-out", required_argument, NULL, OPT_VIDEO_OUT},
+    {"video-format", required_argument, NULL, OPT_VIDEO_FORMAT},
+    {"audio-out", required_argument, NULL, OPT_AUDIO_OUT},
+    {"wav-out", required_argument, NULL, OPT_WAV_OUT},
+    {"prefetch", required_argument, NULL, OPT_PREFETCH},
+    {"in-cache", required_argument, NULL, OPT_IN_CACHE},
+    {"out-backend", required_argument, NULL, OPT_OUT_BACKEND},
+    {"png-threads", required_argument, NULL, OPT_PNG_THREADS},
+    {"apng", required_argument, NULL, OPT_APNG},
+    {"bytes-out", required_argument, NULL, OPT_BYTES_OUT},
+    {"discard-output", no_argument, NULL, OPT_DISCARD_OUTPUT},
+    {"chain", required_argument, NULL, OPT_CHAIN},
+    {"chain-cache", required_argument, NULL, OPT_CHAIN_CACHE},
+    {NULL, 0, NULL, 0}
+};
+
 int get_options(int argc, char* argv[]) {
     int i, c;
     int na = 0; // Number of appearances of flag '-a': ivm_emu ... -a first -a second ...
-    while ((c = getopt(argc, argv, "m:o:i:a:L:")) != -1) {
+    while ((c = getopt_long(argc, argv, "m:o:i:a:L:", long_options, NULL)) != -1) {
         switch (c) {
           case 'm': opt_maxmem = atol(optarg)>0?atol(optarg):opt_maxmem; break;
           case 'o': outDir = optarg; break;
@@ -428,9 +524,63 @@ int get_options(int argc, char* argv[]) {
                     if (na==1) {envFile = optarg; na++; break;} // The 2nd. -a argument is the environment file
                     break;
           case 'L': segment_start = atol(optarg)>0?atol(optarg):0; break;
+          case OPT_MMAP: opt_mmap = 1; break;
+          case OPT_SNAPSHOT: opt_snapshot = optarg; break;
+          case OPT_RESTORE: opt_restore = optarg; break;
+          case OPT_RECODE_CACHE: opt_recode_cache = optarg; break;
+          case OPT_SERVER: opt_server = optarg; break;
+          case OPT_MEM_REPORT: opt_mem_report = 1; break;
+          case OPT_PNG:
+            for (opt_png = PNG_BUILTIN; opt_png > PNG_DEFAULT; opt_png--) {
+                if (!strcmp(optarg, png_profiles[opt_png])) break;
+            }
+            if (strcmp(optarg, png_profiles[opt_png])) {
+                fprintf(OUTPUT_MSG, "Unknown PNG profile '%s' (default, fast, store or builtin)\n", optarg);
+                return 0;
+            }
+            break;
+          case OPT_VIDEO_OUT: opt_video_out = optarg; break;
+          case OPT_VIDEO_FORMAT:
+            for (opt_video_format = VIDEO_PPM; opt_video_format > VIDEO_Y4M; opt_video_format--) {
+                if (!strcmp(optarg, video_formats[opt_video_format])) break;
+            }
+            if (strcmp(optarg, video_formats[opt_video_format])) {
+                fprintf(OUTPUT_MSG, "Unknown video format '%s' (y4m, rgb or ppm)\n", optarg);
+                return 0;
+            }
+            break;
+          case OPT_AUDIO_OUT: opt_audio_out = optarg; break;
+          case OPT_WAV_OUT: opt_wav_out = optarg; break;
+          case OPT_PREFETCH: opt_prefetch = atoi(optarg)>0?atoi(optarg):0; break;
+          case OPT_IN_CACHE: opt_in_cache = atol(optarg)>0?atol(optarg):0; break;
+          case OPT_OUT_BACKEND:
+            for (opt_out_backend = OUT_URING; opt_out_backend > OUT_SYNC; opt_out_backend--) {
+                if (!strcmp(optarg, out_backends[opt_out_backend])) break;
+            }
+            if (strcmp(optarg, out_backends[opt_out_backend])) {
+                fprintf(OUTPUT_MSG, "Unknown output backend '%s' (sync, thread or uring)\n", optarg);
+                return 0;
+            }
+            break;
+          case OPT_PNG_THREADS: opt_png_threads = atoi(optarg)>0?atoi(optarg):1; break;
+          case OPT_APNG: opt_apng = optarg; break;
+          case OPT_BYTES_OUT: opt_bytes_out = optarg; break;
+          case OPT_DISCARD_OUTPUT: opt_discard_output = 1; break;
+          case OPT_CHAIN:
+            if (opt_num_chain == MAX_CHAIN) {
+                fprintf(OUTPUT_MSG, "Too many stages in the chain (at most %d --chain)\n", MAX_CHAIN);
+                return 0;
+            }
+            opt_chain[opt_num_chain++] = optarg;
+            break;
+          case OPT_CHAIN_CACHE: opt_chain_cache = atol(optarg)>0?atol(optarg):0; break;
           case '?': // pass through
           default:
-            if (optopt == 'm')
+            if (optopt >= OPT_MMAP) // Long option (getopt_long sets optopt to its value)
+              fprintf(OUTPUT_MSG, "Option %s requires an argument.\n", argv[optind-1]);
+            else if (optopt == 0)   // Unknown long option
+              fprintf(OUTPUT_MSG, "Unknown option `%s'.\n", argv[optind-1]);
+            else if (optopt == 'm')
               fprintf(OUTPUT_MSG, "Option -%c requires an argument.\n", optopt);
             else
               fprintf(OUTPUT_MSG, "Unknown option `\\x%x'.\n", optopt);
@@ -443,14 +593,46 @@ int get_options(int argc, char* argv[]) {
         break;
     }
 
-    if (!opt_bycodefile) {
+    // When restoring a snapshot, the binary is only used for its symbols
+    if (!opt_bycodefile && !opt_restore) {
         fprintf(OUTPUT_MSG, "Usage:\n\t%s [-m <size in bytes>] "
                             "[-o <output dir>] [-i <input dir>] "
-                            "[-a <arg file> [-a <env file>]] <ivm binary file>\n",
+                            "[-a <arg file> [-a <env file>]] [--mmap] "
+                            "[--snapshot <file>] [--restore <file>] [--recode-cache <dir>] "
+                            "[--server <socket>] [--mem-report] "
+                            "[--png default|fast|store|builtin] [--video-out <file|->] "
+                            "[--video-format y4m|rgb|ppm] [--audio-out <file|->] "
+                            "[--wav-out <file>] [--prefetch N] "
+                            "[--in-cache <bytes>] [--out-backend sync|thread|uring] "
+                            "[--png-threads N] [--apng <file>] [--bytes-out <fd|file|->] "
+                            "[--discard-output] [--chain <ivm binary file>]... [--chain-cache <bytes>] "
+                            "<ivm binary file>\n",
                 argv[0]);
         return 0;
     }
 
+    if (opt_server && opt_restore) {
+        fprintf(OUTPUT_MSG, "Options --server and --restore are not compatible\n");
+        return 0;
+    }
+
+    if (opt_discard_output && (outDir || opt_video_out || opt_audio_out || opt_wav_out
+                               || opt_apng || opt_bytes_out)) {
+        fprintf(OUTPUT_MSG, "Option --discard-output is not compatible with -o and the output streams\n");
+        return 0;
+    }
+
+    #ifdef NO_IO
+    if (opt_num_chain) {
+        fprintf(OUTPUT_MSG, "Option --chain needs a version with IO\n");
+        return 0;
+    }
+    #endif
+    if (opt_num_chain && (opt_server || opt_snapshot || opt_restore)) {
+        fprintf(OUTPUT_MSG, "Option --chain is not compatible with --server, --snapshot and --restore\n");
+        return 0;
+    }
+
     #if (VERBOSE>0)
         fprintf(OUTPUT_MSG, "opt_maxmem=%ld, opt_bycodefile='%s'\n",
                 opt_maxmem, opt_bycodefile);
@@ -462,6 +644,44 @@ int get_options(int argc, char* argv[]) {
             fprintf(OUTPUT_MSG, "argFile=%s\n", argFile);
         if (envFile)
             fprintf(OUTPUT_MSG, "envFile=%s\n", envFile);
+        if (opt_mmap)
+            fprintf(OUTPUT_MSG, "mmap=on\n");
+        if (opt_snapshot)
+            fprintf(OUTPUT_MSG, "snapshot=%s\n", opt_snapshot);
+        if (opt_restore)
+            fprintf(OUTPUT_MSG, "restore=%s\n", opt_restore);
+        if (opt_recode_cache)
+            fprintf(OUTPUT_MSG, "recode-cache=%s\n", opt_recode_cache);
+        if (opt_server)
+            fprintf(OUTPUT_MSG, "server=%s\n", opt_server);
+        if (opt_mem_report)
+            fprintf(OUTPUT_MSG, "mem-report=on\n");
+        if (opt_png)
+            fprintf(OUTPUT_MSG, "png=%s\n", png_profiles[opt_png]);
+        if (opt_video_out)
+            fprintf(OUTPUT_MSG, "video-out=%s (%s)\n", opt_video_out, video_formats[opt_video_format]);
+        if (opt_audio_out)
+            fprintf(OUTPUT_MSG, "audio-out=%s\n", opt_audio_out);
+        if (opt_wav_out)
+            fprintf(OUTPUT_MSG, "wav-out=%s\n", opt_wav_out);
+        if (inpDir)
+            fprintf(OUTPUT_MSG, "prefetch=%d\n", opt_prefetch);
+        if (opt_in_cache)
+            fprintf(OUTPUT_MSG, "in-cache=%lu\n", opt_in_cache);
+        if (opt_out_backend)
+            fprintf(OUTPUT_MSG, "out-backend=%s\n", out_backends[opt_out_backend]);
+        if (opt_png_threads > 1)
+            fprintf(OUTPUT_MSG, "png-threads=%d\n", opt_png_threads);
+        if (opt_apng)
+            fprintf(OUTPUT_MSG, "apng=%s\n", opt_apng);
+        if (opt_bytes_out)
+            fprintf(OUTPUT_MSG, "bytes-out=%s\n", opt_bytes_out);
+        if (opt_discard_output)
+            fprintf(OUTPUT_MSG, "discard-output=on\n");
+        for (i = 0; i < opt_num_chain; i++)
+            fprintf(OUTPUT_MSG, "chain=%s\n", opt_chain[i]);
+        if (opt_chain_cache)
+            fprintf(OUTPUT_MSG, "chain-cache=%lu\n", opt_chain_cache);
     #endif
 
     return 1;
@@ -511,10 +731,76 @@ int ivm_read_bin(char *filename, unsigned long offset, unsigned long *m_start, u
     return 0;
 }
 
+/*
+    Map a ivm binary bytecode file into memory starting at
+    position 'offset' instead of reading it. The mapping is
+    private, so recoded instructions and stores into the program
+    data never reach the file, and only the pages that are
+    actually accessed are faulted in from the page cache (clean
+    pages are shared among emulator processes running the same
+    binary).
+    Return -1 if the file can not be mapped at that position
+    (e.g. 'offset' is not page aligned), so the caller can fall
+    back to ivm_read_bin()
+*/
+unsigned long mappedPages = 0; // Pages of the binary mapped from its file, from execStart
+
+int ivm_map_bin(char *filename, unsigned long offset, unsigned long *m_start, unsigned long *m_end)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if (offset % pagesize) {
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        fprintf(OUTPUT_MSG, "Can't open file '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    long fs = st.st_size; // File size
+    if ((unsigned long)fs > MemBytes-offset) {
+        fprintf(OUTPUT_MSG, "Not enough memory to load '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // Bytes in the last page beyond the end of file read as zero,
+    // the same as the rest of the (anonymous) memory
+    void *p = mmap(&Mem[offset], fs, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_FIXED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(OUTPUT_MSG, "Error mapping '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    #if (VERBOSE>0)
+        fprintf(OUTPUT_MSG, "Mapped %ld bytes from '%s'\n", fs, filename);
+    #endif
+
+    *m_start = offset;
+    *m_end   = offset + fs -1;
+    mappedPages = (fs + pagesize - 1)/pagesize;
+
+    return 0;
+}
+
 //#if (VERBOSE >= 3)
 #include "ivm_emu_hash_table.h"
 sym_table_t *Ts = NULL; // global struct for the symbol table
 
+#include "ivm_emu_snapshot.h"
+#include "ivm_emu_server.h"
+#ifndef NO_IO
+#include "ivm_emu_chain.h"
+#endif
+
 /*
   Get the name of symbol file from binary filename.
   Basically, replace .b or .bin extension by .sym
@@ -764,17 +1050,141 @@ void print_insn(char *pc){
      #endif
 }
 
+/*
+    Report how much of the memory the program has used:
+    resident pages of the code (loaded files), heap and stack,
+    and a value for -m that would be enough for this run.
+    The stack is the run of resident pages below the top of
+    the memory; its lowest word not zero (or SP if lower) is
+    taken as the lowest SP reached
+*/
+void ivm_mem_report(char *sp)
+{
+    unsigned long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned long npages = (MemBytes + pagesize - 1)/pagesize;
+    unsigned char *resident = malloc(npages);
+    if (!resident || mincore(Mem, MemBytes, resident)) {
+        fprintf(OUTPUT_MSG, "Memory report not available\n\n");
+        free(resident);
+        return;
+    }
+
+    unsigned long loadEnd = MAX(execEnd, MAX(argEnd, envEnd)) + BYTESPERWORD;
+    unsigned long codePages = loadEnd/pagesize + 1;
+    unsigned long ncode = 0, nheap = 0, nstack = 0;
+    unsigned long i;
+
+    // The pages mapped from the binary file (--mmap) are resident when
+    // they are in the page cache, touched or not: they are not counted
+    unsigned long mapFirst = execStart/pagesize, mapEnd = mapFirst + mappedPages;
+    for (i = 0; i < codePages && i < npages; i++) {
+        if (i < mapFirst || i >= mapEnd) ncode += resident[i] & 1;
+    }
+
+    // Stack: resident pages from the top down. SP is only known to
+    // have reached the lowest of them, so the stack used is taken from
+    // its start (up to a page more than the real one, never less)
+    unsigned long stackPage = npages;
+    while (stackPage > codePages && (resident[stackPage-1] & 1)) {
+        stackPage--;
+        nstack++;
+    }
+    unsigned long lowSP = MemBytes - BYTESPERWORD;
+    if (nstack > 0) {
+        lowSP = stackPage*pagesize;
+    }
+    lowSP = MIN(lowSP, addr2idx(sp));
+
+    // Heap: resident pages between the loaded files and the stack
+    unsigned long heapTop = loadEnd;
+    for (i = codePages; i < stackPage; i++) {
+        if (resident[i] & 1) {
+            nheap++;
+            heapTop = (i+1)*pagesize - 1;
+        }
+    }
+    free(resident);
+
+    // Heap and stack reached, plus a 25% margin, in whole MiB
+    unsigned long stackBytes = MemBytes - lowSP;
+    unsigned long needed = heapTop + 1 + stackBytes;
+    unsigned long mb = 1024*1024;
+    unsigned long recommended = ((needed + needed/4 + mb - 1)/mb)*mb;
+
+    fprintf(OUTPUT_MSG, "Memory report (page size %lu bytes, memory %lu bytes):\n", pagesize, MemBytes);
+    fprintf(OUTPUT_MSG, "  code  [%#lx - %#lx]: %lu resident pages", 0UL, loadEnd, ncode);
+    if (mappedPages > 0) {
+        fprintf(OUTPUT_MSG, " (and %lu pages mapped from the binary, not counted)", mappedPages);
+    }
+    fprintf(OUTPUT_MSG, "\n");
+    if (nheap > 0) {
+        fprintf(OUTPUT_MSG, "  heap  [%#lx - %#lx]: %lu resident pages\n", loadEnd+1, heapTop, nheap);
+    } else {
+        fprintf(OUTPUT_MSG, "  heap: no resident pages\n");
+    }
+    fprintf(OUTPUT_MSG, "  stack [%#lx - %#lx]: %lu resident pages\n", lowSP, MemBytes-1, nstack);
+    fprintf(OUTPUT_MSG, "  Lowest SP: %#lx or above (%lu bytes of stack, whole pages)\n", lowSP, stackBytes);
+    fprintf(OUTPUT_MSG, "  Resident: %lu bytes; used: %lu bytes; recommended: -m %lu\n\n",
+            (ncode+nheap+nstack)*pagesize, needed, recommended);
+}
+
 void reset_std_streams()
 {
     // Restore stream orientation after just in case wprintf()
     // and printf() were mixed up
     // Note that streams where IVM writes need to be not buffered
-    if (freopen(NULL, "a", OUTPUT_PUTCHAR)){};
-    if (freopen(NULL, "a", OUTPUT_PUTBYTE)){};
+    // (sockets, as in server mode, cannot be reopened: freopen()
+    //  would fail and close them)
+    struct stat st;
+    if (fstat(fileno(OUTPUT_PUTCHAR), &st) || !S_ISSOCK(st.st_mode))
+        if (freopen(NULL, "a", OUTPUT_PUTCHAR)){};
+    if (fstat(fileno(OUTPUT_PUTBYTE), &st) || !S_ISSOCK(st.st_mode))
+        if (freopen(NULL, "a", OUTPUT_PUTBYTE)){};
     setvbuf(OUTPUT_PUTCHAR, NULL, _IONBF, 0);
     setvbuf(OUTPUT_PUTBYTE, NULL, _IONBF, 0);
 }
 
+// Standard input of READ_CHAR. A terminal is set to raw mode (no echo,
+// no line editing) at the first READ_CHAR and kept so until the end of
+// the run; any other input (file, pipe, socket) is read through a large
+// buffer, without termios calls
+#define STDIN_BUF_SIZE (1<<20)
+#if (!IVM_TERMIOS)
+#define TTY_DEF
+#define TTY_NEW
+#else
+struct termios tty_def, tty_new;
+int tty_in = 0;  // stdin is a terminal
+int tty_raw = 0; // the terminal is in raw mode
+void tty_restore()
+{
+    if (tty_raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &tty_def);
+        tty_raw = 0;
+    }
+}
+#define TTY_DEF tty_restore()
+#define TTY_NEW do{if (tty_in && !tty_raw) {tcsetattr(STDIN_FILENO, TCSANOW, &tty_new); tty_raw = 1;}}while(0)
+#endif
+
+void init_stdin()
+{
+    if (!isatty(STDIN_FILENO)) {
+        setvbuf(stdin, NULL, _IOFBF, STDIN_BUF_SIZE);
+        return;
+    }
+    #if (IVM_TERMIOS)
+    if (tcgetattr(STDIN_FILENO, &tty_def) == 0) { // save terminal characteristics
+        tty_new = tty_def;
+        tty_new.c_lflag &= ~(ICANON | ECHO);
+        tty_new.c_cc[VTIME] = 0;
+        tty_new.c_cc[VMIN] = 1;
+        tty_in = 1;
+        atexit(tty_restore); // also when exiting on errors
+    }
+    #endif
+}
+
 // setjmp/longjmp stuf
 jmp_buf env;
 void signal_handler(int s)
@@ -782,6 +1192,24 @@ void signal_handler(int s)
     longjmp(env,s); // return the signal number
 }
 
+// Snapshot requested by a signal (SIGUSR1): all the entries of the
+// dispatch table are redirected to the snapshot code, which runs
+// before the next instruction and restores the table from addr_saved.
+// The table is volatile, so that every dispatch reads the entry from
+// memory and sees the handler's writes. This costs nothing: the entry
+// is indexed by the opcode just fetched, so it was read from memory
+// anyway; only the compiler can no longer merge or hoist those reads.
+// Entries are aligned pointers, written in one store each, and the
+// handler ends before the interpreter goes on: a table half redirected
+// is never seen, and a trap left over only takes a second snapshot
+void* addr_saved[256];
+void* snapshot_trap;
+void snapshot_signal_handler(int s)
+{
+    (void)s;
+    for (int i = 0; i < 256; i++) addr[i] = snapshot_trap;
+}
+
 
 // Stack operations
 void push(WORD_T v);
@@ -831,20 +1259,6 @@ int main(int argc, char* argv[])
 
     char *filename;
 
-    #if (!IVM_TERMIOS)
-    #define TTY_DEF
-    #define TTY_NEW
-    #else
-    struct termios tty_def, tty_new;
-    tcgetattr(STDIN_FILENO, &tty_def);  // save terminal characteristics
-    tty_new = tty_def;
-    tty_new.c_lflag &= ~(ICANON | ECHO);
-    tty_new.c_cc[VTIME] = 0;
-    tty_new.c_cc[VMIN] = 1;
-    #define TTY_DEF do{tcsetattr(STDIN_FILENO, TCSANOW, &tty_def );}while(0)
-    #define TTY_NEW do{tcsetattr(STDIN_FILENO, TCSANOW, &tty_new );}while(0)
-    #endif
-
     fprintf(OUTPUT_MSG, "Yet another ivm emulator, %s\n", VERSION);
     fprintf(OUTPUT_MSG, "Compatible with ivm-2.1\n");
     char *str = "Compiled with:";
@@ -897,30 +1311,24 @@ int main(int argc, char* argv[])
         }
     }
 
+    // Each stage of a chain goes on in its own process
+    #ifndef NO_IO
+    if (opt_num_chain) ivm_chain();
+    #endif
+
     // Get options
     filename = opt_bycodefile;
     MemBytes = opt_maxmem;
 
     // Prepare the memory
-    Mem = (char*)malloc(MemBytes * sizeof(char));
-    memset(Mem, 0, MemBytes);
-
-    
-    #ifndef NO_IO
-    ioInitIn();
-    ioInitOut();
-    #ifdef PARALLEL_OUTPUT
-        // if environment variable NUM_THREADS=N exists, this value is used instead
-        // of any previous value as the maximum number of processes
-        char *nthreads_str = getenv("NUM_THREADS");
-        if (nthreads_str) maxproc = atoi(nthreads_str);
-        // Must be 2 or more: 1 thread for emulation and (N-1) threads for io
-        maxproc = (maxproc<1)?1:maxproc;
-        #if (VERBOSE > 0)
-        fprintf(OUTPUT_MSG, "maxproc=%d\n", maxproc);
-        #endif
-    #endif
-    #endif
+    // (anonymous pages are page aligned, zero filled and only
+    //  committed when touched, so a large -m costs nothing upfront)
+    Mem = (char*)mmap(NULL, MemBytes * sizeof(char), PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (Mem == MAP_FAILED) {
+        fprintf(OUTPUT_MSG, "Can't allocate %lu bytes of memory\n", MemBytes);
+        exit(EXIT_FAILURE);
+    }
 
     fprintf(OUTPUT_MSG,"\n");
 
@@ -928,20 +1336,34 @@ int main(int argc, char* argv[])
     init_insn_addr(addr);
     init_insn_attributes(insn_attributes);
 
-    // Read bytecode file
-    ivm_read_bin(filename, segment_start, &execStart, &execEnd);
+    // Read bytecode file (unless the memory is restored from a snapshot)
+    if (!opt_restore && (!opt_mmap || ivm_map_bin(filename, segment_start, &execStart, &execEnd))) {
+        ivm_read_bin(filename, segment_start, &execStart, &execEnd);
+    }
     #if (VERBOSE>0)
     fprintf(OUTPUT_MSG, "First byte of the program indexed by %#lx (=%ld), last byte by %#lx (=%ld)\n",
             execStart, execStart, execEnd, execEnd);
     fprintf(OUTPUT_MSG, "\n");
     #endif
 
+    // Apply the recodes saved by previous runs of this binary
+    #ifdef RECODE_INSN
+    if (opt_recode_cache && !opt_restore) {
+        #if (VERBOSE>0)
+        long nrecoded = ivm_recode_cache_load(opt_recode_cache, filename);
+        fprintf(OUTPUT_MSG, "%ld recoded instructions loaded from cache\n\n", nrecoded);
+        #else
+        ivm_recode_cache_load(opt_recode_cache, filename);
+        #endif
+    }
+    #endif
+
     // Read sym file if available (to show labels when tracing or in case of error)
     //#if (VERBOSE >= 3)
-    char *symfile = get_ivm_sym_filename(filename);
+    char *symfile = filename ? get_ivm_sym_filename(filename) : NULL;
 
     Ts = init_symtable(12346791);
-    long nsym = ivm_read_sym(symfile);  // ivm_read_sym uses the global symbol table Ts
+    long nsym = symfile ? ivm_read_sym(symfile) : 0;  // ivm_read_sym uses the global symbol table Ts
 
     #if (VERBOSE >=1)
     if (nsym>0) {
@@ -956,10 +1378,31 @@ int main(int argc, char* argv[])
     free(symfile);
     //#endif
 
-    *(uint64_t*)&Mem[execEnd+1]=0;
+    // In server mode, what follows is done by the child forked for each job
+    // (the memory, the symbols and the recodes are shared copy-on-write)
+    if (opt_server) ivm_server(opt_server);
+
+    #ifndef NO_IO
+    ioInitIn();
+    ioInitOut();
+    #ifdef PARALLEL_OUTPUT
+        // if environment variable NUM_THREADS=N exists, this value is used instead
+        // of any previous value as the maximum number of processes
+        char *nthreads_str = getenv("NUM_THREADS");
+        if (nthreads_str) maxproc = atoi(nthreads_str);
+        // Must be 2 or more: 1 thread for emulation and (N-1) threads for io
+        maxproc = (maxproc<1)?1:maxproc;
+        #if (VERBOSE > 0)
+        fprintf(OUTPUT_MSG, "maxproc=%d\n", maxproc);
+        #endif
+        ioInitWorkers(maxproc-1);
+    #endif
+    #endif
+
+    if (!opt_restore) *(uint64_t*)&Mem[execEnd+1]=0;
 
     // Read argument file
-    if (argFile){
+    if (argFile && !opt_restore){
         ivm_read_bin(argFile, execEnd+9, &argStart, &argEnd);
         *(uint64_t*)(&Mem[execEnd+1]) = argEnd - argStart + 1;
         #if (VERBOSE>0)
@@ -970,7 +1413,7 @@ int main(int argc, char* argv[])
     }
 
     // Read environment file (it follows argument file)
-    if (envFile){
+    if (envFile && !opt_restore){
         ivm_read_bin(envFile, argEnd+9, &envStart, &envEnd);
         *(uint64_t*)(&Mem[argEnd+1]) = envEnd - envStart + 1;
         #if (VERBOSE>0)
@@ -1018,15 +1461,31 @@ int main(int argc, char* argv[])
         bzero(samples, 256*sizeof(unsigned long));
         #define STEPCOUNT_ACTION(n)  do{samples[probe]+=n;}while(0)
         #define FETCHCOUNT_ACTION    do{fetchs++;}while(0)
+        #define FETCHCOUNT_UNDO      do{fetchs--;}while(0)
+        #define SNAPSHOT_SAVE(pc)    ivm_save_snapshot(opt_snapshot, pc, samples, fetchs, probe)
     #else
         #define STEPCOUNT_ACTION(n)
         #define FETCHCOUNT_ACTION
+        #define FETCHCOUNT_UNDO
+        #define SNAPSHOT_SAVE(pc)    ivm_save_snapshot(opt_snapshot, pc, NULL, 0, probe)
     #endif
 
+    // Resume from a snapshot: memory, PC, SP, probe counters and I/O state
+    if (opt_restore) {
+        #ifdef STEPCOUNT
+        ivm_restore_snapshot(opt_restore, samples, &fetchs, &probe);
+        #else
+        ivm_restore_snapshot(opt_restore, NULL, NULL, &probe);
+        #endif
+    }
+
     #ifdef RECODE_INSN
+    #define RECODE_LOG(X)   do{ if (recode_key)                          \
+                            recode_log_add(PC-1, *(uint8_t *)(PC-1), OPCODE_##X); }while(0)
     #define MODIF2(X)   HISTOGRAM_UNDO(opcode1);         \
                         HISTOGRAM_RECODE(OPCODE_##X);    \
                         HISTOGRAM_ACTION(OPCODE_##X);    \
+                        RECODE_LOG(X);                   \
                         *(uint8_t *)(PC-1)=OPCODE_##X; X:
     #else // use (existing) patterns but no recode insn
     #define MODIF2(X)   HISTOGRAM_UNDO(opcode1);         \
@@ -1060,13 +1519,32 @@ int main(int argc, char* argv[])
     #define NEXT    FETCH; EXEC
 
     reset_std_streams();
-    TTY_DEF;
+    init_stdin();
+
+    // Output that goes nowhere: bind its instructions to DISCARD_*
+    #ifndef NO_IO
+    int discarded = ioDiscarded();
+    #else
+    int discarded = opt_discard_output ? ~0 : 0;
+    #endif
+    if (discarded & DISCARD_FRAMES) {
+        addr[OPCODE_NEW_FRAME] = &&DISCARD_NEW_FRAME;
+        addr[OPCODE_SET_PIXEL] = &&DISCARD_5;
+        addr[OPCODE_BLIT] = &&DISCARD_1;
+        addr[OPCODE_ADD_SAMPLE] = &&DISCARD_2;
+    }
+    if (discarded & DISCARD_BYTES) addr[OPCODE_PUT_BYTE] = &&DISCARD_1;
+    if (discarded & DISCARD_CHARS) addr[OPCODE_PUT_CHAR] = &&DISCARD_1;
+
+    snapshot_trap = &&SNAPSHOT_TRAP;
+    for (int i = 0; i < 256; i++) addr_saved[i] = addr[i];
 
     error=setjmp(env);
     if (error == 0) {
         signal(SIGINT,signal_handler);
         signal(SIGSEGV,signal_handler);
         signal(SIGFPE,signal_handler);
+        if (opt_snapshot) signal(SIGUSR1,snapshot_signal_handler);
         NEXT;
     }
 
@@ -2510,10 +2988,19 @@ int main(int argc, char* argv[])
         push(0);
         push(0);
         NEXT;
+    BLIT:
+        a = pop();
+        //NO_IO: printing instruction
+        fprintf(OUTPUT_PUTBYTE, "blit! %lu\n", a);
+        NEXT;
+    READ_ROWS:
+        a = pop();
+        //NO_IO: printing instruction
+        fprintf(OUTPUT_PUTBYTE, "read_rows! %lu\n", a);
+        NEXT;
     READ_CHAR:
         TTY_NEW;
         x = getchar();
-        TTY_DEF;
         if (x == EOF) {
             clearerr(stdin);
             x=4; // ascii 4 = ^D
@@ -2523,14 +3010,12 @@ int main(int argc, char* argv[])
     #else
     // from github.com/preservationvm/ivm-implementations/blob/master/OtherMachines/vm.c
     READ_FRAME:
+        u = pop();
         #ifdef PARALLEL_OUTPUT
-        // wait all pending output
-        while (nproc>0) {
-           if (waitpid(-1, &status, 0))
-                nproc--;
-        }
+        // wait for the pending output it may read
+        ioWaitInput(u);
         #endif
-        ioReadFrame(pop(), &u, &v); // u -> x ; v -> y
+        ioReadFrame(u, &u, &v); // u -> x ; v -> y
         push(u);
         push(v);
         NEXT;
@@ -2541,29 +3026,8 @@ int main(int argc, char* argv[])
     NEW_FRAME:
         r = pop(); v = pop(); u = pop();
         #ifdef PARALLEL_OUTPUT
-            if (nproc >= maxproc){
-                waitpid(-1, &status, 0);
-                nproc--;
-            }
-            pid_t pid = fork();
-            if (pid == 0){
-                child = 1;
-                ioFlush();
-                exit(0);
-            } else if (pid > 0) {
-                outputCounter++;
-                currentText.used = 0;
-                currentBytes.used = 0;
-                currentSamples.used = 0;
-                currentOutImage.used = 0;
-                ioNewFrame(u, v, r);
-                fflush(OUTPUT_PUTCHAR);
-                nproc++;
-                while ((nproc > 0) && (waitpid(-1, &status, WNOHANG) > 0)){nproc--;};
-            } else {
-                printf("** Error in fork\n");
-                exit(EXIT_FAILURE);
-            }
+            ioFlushParallel();
+            ioNewFrame(u, v, r);
         #else
             ioFlush();
             ioNewFrame(u, v, r);
@@ -2575,6 +3039,12 @@ int main(int argc, char* argv[])
         v = pop(); u = pop();
         ioSetPixel(u, v, r, a, b); // u -> x ; v -> y ; a -> r
         NEXT;
+    BLIT:
+        ioBlit((uint64_t*)pop()); // Descriptor: x, y, w, h, src, stride
+        NEXT;
+    READ_ROWS:
+        ioReadRows((uint64_t*)pop()); // Descriptor: dst, stride, first row, rows
+        NEXT;
     ADD_SAMPLE:
         u = pop(); v = pop();
         ioAddSample(v, u); // u -> x ; v -> y
@@ -2593,16 +3063,32 @@ int main(int argc, char* argv[])
     //PUT_CHAR: ioPutChar(pop()); NEXT;
     //PUT_BYTE: ioPutByte(pop()); NEXT;
     READ_CHAR:
+        ioConsoleFlush(); // A prompt must be seen before waiting for the answer
         TTY_NEW;
         u = ioReadChar();
-//fflush(NULL);
-        TTY_DEF;
         if (feof(stdin)) {
             clearerr(stdin);
         }
         push(u);
         NEXT;
     #endif
+    //-----------------
+    // Discarded output (see ioDiscarded()): only the operands are popped
+    DISCARD_NEW_FRAME:
+        SP += 3 * BYTESPERWORD;
+        #ifndef NO_IO
+        ioSkipFrame();
+        #endif
+        NEXT;
+    DISCARD_5:
+        SP += 5 * BYTESPERWORD;
+        NEXT;
+    DISCARD_2:
+        SP += 2 * BYTESPERWORD;
+        NEXT;
+    DISCARD_1:
+        SP += BYTESPERWORD;
+        NEXT;
 
     //-----------------
     BREAK:
@@ -2640,6 +3126,24 @@ int main(int argc, char* argv[])
         STEPCOUNT_ACTION(-1);
         #endif
         NEXT;
+    SNAPSHOT:
+        #if (VERBOSE<3)
+        STEPCOUNT_ACTION(-1);
+        #endif
+        if (opt_snapshot) {
+            SNAPSHOT_SAVE(PC);
+        }
+        NEXT;
+    SNAPSHOT_TRAP:
+        // Reached through the dispatch table after SIGUSR1; the
+        // instruction just fetched has not been executed yet
+        for (int i = 0; i < 256; i++) addr[i] = addr_saved[i];
+        STEPCOUNT_ACTION(-1);
+        FETCHCOUNT_UNDO;
+        SNAPSHOT_SAVE(PC-1);
+        STEPCOUNT_ACTION(1);
+        FETCHCOUNT_ACTION;
+        goto *addr[opcode1];
     //-----------------
 
     HALT:
@@ -2647,27 +3151,30 @@ int main(int argc, char* argv[])
     signal(SIGINT,SIG_DFL);
     signal(SIGSEGV,SIG_DFL);
     signal(SIGFPE,SIG_DFL);
+    if (opt_snapshot) signal(SIGUSR1,SIG_IGN);
 
     // At exit, reset std stream orientation
     reset_std_streams();
     TTY_DEF;
 
     #ifdef PARALLEL_OUTPUT
-    if (child){
-        exit(0);
-    } else {
-       while (nproc>0) {
-           if (waitpid(-1, &status, 0))
-                nproc--;
-       }
-    }
+    ioStopWorkers(); // Once all pending frames are written
     #endif
 
     #ifdef WITH_IO
     ioFlush();
+    ioWaitAsync();
+    ioCloseStreams();
+    ioCloseConsoleFiles();
     #endif
     fprintf(OUTPUT_MSG, "\n");
 
+    #ifdef RECODE_INSN
+    if (recode_key) {
+        ivm_recode_cache_save(opt_recode_cache);
+    }
+    #endif
+
     #define HUMANSIZE(x) ((double)(((x)>1e12)?((x)/1.0e12):((x)>1e9)?((x)/1.0e9):((x)>1.0e6)?((x)/1.0e6):((x)>1e3)?((x)/1.0e3):(x)))
     #define HUMANPREFIX(x)  (((x)>1e12)?"T":((x)>1e9)?"G":((x)>1e6)?"M":((x)>1e3)?"K":"")
 
@@ -2711,6 +3218,10 @@ int main(int argc, char* argv[])
     }
     #endif
 
+    if (opt_mem_report) {
+        ivm_mem_report(SP);
+    }
+
     int ret_val;
     if (error == SIGSEGV) {
         fprintf(OUTPUT_MSG, "error: segmentation fault\n\n");
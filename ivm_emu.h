@@ -456,6 +456,11 @@ enum OPCODES {
 	OPCODE_TRACE      = 0xf1,
 	OPCODE_PROBE      = 0xf2,
 	OPCODE_PROBE_READ = 0xf3,
+	OPCODE_SNAPSHOT   = 0xf4,
+
+// Bulk IO extensions
+	OPCODE_BLIT       = 0xf5,
+	OPCODE_READ_ROWS  = 0xf6,
 
 
 // native IO insn
@@ -524,7 +529,9 @@ ATTR_NATIVE(A,ADD_SAMPLE,0); \
 ATTR_NATIVE(A,NEW_FRAME,0); \
 ATTR_NATIVE(A,SET_PIXEL,0); \
 ATTR_NATIVE(A,READ_PIXEL,0); \
-ATTR_NATIVE(A,READ_FRAME,0);
+ATTR_NATIVE(A,READ_FRAME,0); \
+ATTR_NATIVE(A,BLIT,0); \
+ATTR_NATIVE(A,READ_ROWS,0);
 
 
 #if (defined(RECODE_NATIVE_INSN) || defined(RECODE_INSN))
@@ -771,7 +778,8 @@ ATTRIBUTE(A,XOR_1_LT,3);
 ATTR_NATIVE(A,BREAK,0); \
 ATTR_NATIVE(A,TRACE,1); \
 ATTR_NATIVE(A,PROBE,1); \
-ATTR_NATIVE(A,PROBE_READ,0);
+ATTR_NATIVE(A,PROBE_READ,0); \
+ATTR_NATIVE(A,SNAPSHOT,0);
 
 
 #define init_insn_attributes(A)	\
@@ -852,7 +860,9 @@ BIND_NATIVE(B,ADD_SAMPLE); \
 BIND_NATIVE(B,NEW_FRAME); \
 BIND_NATIVE(B,SET_PIXEL); \
 BIND_NATIVE(B,READ_PIXEL); \
-BIND_NATIVE(B,READ_FRAME);
+BIND_NATIVE(B,READ_FRAME); \
+BIND_NATIVE(B,BLIT); \
+BIND_NATIVE(B,READ_ROWS);
 
 #ifdef RECODE_NATIVE_INSN
 #define init_addr_new_native_insn(B) \
@@ -1084,7 +1094,8 @@ BIND_LABEL(B,XOR_1_LT);
 BIND_NATIVE(B,BREAK);   \
 BIND_NATIVE(B,TRACE);   \
 BIND_NATIVE(B,PROBE);   \
-BIND_NATIVE(B,PROBE_READ);
+BIND_NATIVE(B,PROBE_READ); \
+BIND_NATIVE(B,SNAPSHOT);
 
 #define init_insn_addr(B)	\
 	do {	\
@@ -0,0 +1,130 @@
+/*
+ Preservation Virtual Machine Project
+
+ Yet another ivm emulator
+
+ Chain of binaries (--chain <binary>, once per stage): the main binary
+ is the first stage, and each --chain binary a stage after it that
+ reads with READ_FRAME the frames of the stage before, in the order
+ they were made. The frames go from stage to stage through a pipe,
+ without PNG files (see chainInFd and chainOutFd in ivm_io.h)
+
+ The stages run at the same time, each one in its own process with
+ its own memory: all but the last one are children of the emulator.
+ The first stage has the input directory (-i), the argument files
+ (-a) and stdin; the last one the output directory (-o) and the
+ output streams, and its exit code is that of the emulator, unless
+ another stage fails. The messages of the other stages go to stderr
+
+ It uses the global options of the emulator (argFile, inpDir, ...),
+ so include it after their definition
+*/
+
+#ifndef __IVM_EMU_CHAIN_H
+#define __IVM_EMU_CHAIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+static pid_t chainPids[MAX_CHAIN];     // Stages before the last one
+
+/*
+    Options of a stage that is not the first one
+*/
+static void chain_not_first(void)
+{
+    argFile = envFile = inpDir = NULL;
+    int null = open("/dev/null", O_RDONLY);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        close(null);
+    }
+}
+
+/*
+    The last stage waits for the others at exit, after closing its
+    input: a stage still making frames then ends with SIGPIPE. If a
+    stage failed or was killed, the emulator ends with its exit code,
+    or 128 + the signal; SIGPIPE too, unless the stage reading its
+    frames ended by itself (it is then how that stage stops the others)
+*/
+static void chain_wait(void)
+{
+    int status[MAX_CHAIN];
+    int ret = 0;
+    int early = !chainInEnded;
+    close(chainInFd);
+    for (int k = 0; k < opt_num_chain; k++) {
+        status[k] = 0;
+        while (waitpid(chainPids[k], &status[k], 0) < 0) {
+            if (errno != EINTR) break;
+        }
+    }
+    for (int k = 0; k < opt_num_chain; k++) {
+        int next_ended = k + 1 == opt_num_chain ? early
+                       : WIFEXITED(status[k+1]) && !WEXITSTATUS(status[k+1]);
+        if (WIFEXITED(status[k]) && WEXITSTATUS(status[k])) {
+            fprintf(OUTPUT_MSG, "** Stage %d of the chain exited with code %d\n", k, WEXITSTATUS(status[k]));
+            if (!ret) ret = WEXITSTATUS(status[k]);
+        } else if (WIFSIGNALED(status[k]) && !(next_ended && WTERMSIG(status[k]) == SIGPIPE)) {
+            fprintf(OUTPUT_MSG, "** Stage %d of the chain was killed by signal %d\n", k, WTERMSIG(status[k]));
+            if (!ret) ret = 128 + WTERMSIG(status[k]);
+        }
+    }
+    if (ret) {
+        // exit() again from an atexit() handler is undefined; the other
+        // handlers were registered later, so they have already run
+        fflush(NULL);
+        _exit(ret);
+    }
+}
+
+/*
+    Start the stages. This function returns in the process of each
+    stage, with the binary and the options of that stage set
+*/
+static void ivm_chain(void)
+{
+    int in = -1;
+    for (int k = 0; k < opt_num_chain; k++) {
+        int fd[2];
+        if (pipe(fd)) {
+            fprintf(OUTPUT_MSG, "** Error creating the pipe of the chain\n");
+            exit(EXIT_FAILURE);
+        }
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(OUTPUT_MSG, "** Error in fork\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(fd[0]);
+            chainInFd = in;
+            chainOutFd = fd[1];
+            if (k > 0) {
+                opt_bycodefile = opt_chain[k-1];
+                chain_not_first();
+            }
+            outDir = opt_video_out = opt_audio_out = opt_wav_out = opt_apng = opt_bytes_out = NULL;
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            return;
+        }
+        chainPids[k] = pid;
+        close(fd[1]);
+        if (in >= 0) close(in);
+        in = fd[0];
+    }
+
+    // The last stage
+    opt_bycodefile = opt_chain[opt_num_chain-1];
+    chainInFd = in;
+    chain_not_first();
+    atexit(chain_wait);
+}
+
+#endif //__IVM_EMU_CHAIN_H
@@ -0,0 +1,187 @@
+/*
+ Preservation Virtual Machine Project
+
+ Yet another ivm emulator
+
+ Fork-server mode (--server <socket>): the binary is loaded once,
+ and each job received on a local UNIX socket is run by a
+ copy-on-write child of the server
+
+ A job is one text line with the options of the run:
+     [-a <arg file> [-a <env file>]] [-i <input dir>] [-o <output dir>]
+ sent through the socket, where a path may be quoted ('...' or "...")
+ or have backslash escapes to hold spaces. After that line, the socket
+ is the stdin, stdout and stderr of the run (e.g. "socat - UNIX-CONNECT:
+ <socket>"), and when the run ends the server sends a last line with its
+ exit status: "Exit status: <code>" or "Killed by signal: <number>"
+
+ It uses the global options of the emulator (argFile, inpDir, ...),
+ so include it after their definition
+*/
+
+#ifndef __IVM_EMU_SERVER_H
+#define __IVM_EMU_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SERVER_MAXLINE 4096
+
+/*
+    Read the job line byte by byte, so that nothing after it
+    (the stdin of the run) is consumed
+*/
+static int server_read_line(int fd, char *line, int size)
+{
+    int n = 0;
+    char c;
+    while (n < size-1 && read(fd, &c, 1) == 1 && c != '\n') {
+        line[n++] = c;
+    }
+    line[n] = '\0';
+    return n;
+}
+
+/*
+    Next word of the job line from *p, unquoted in place (shell-like:
+    '...' is taken as is, "..." and unquoted text take backslash
+    escapes). Return NULL at the end of the line or if a quote is
+    not closed
+*/
+static char *server_next_word(char **p)
+{
+    char *s = *p, *w, *d;
+    while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+    if (*s == '\0') return NULL;
+    w = d = s;
+    char quote = 0;
+    while (*s && (quote || (*s != ' ' && *s != '\t' && *s != '\r'))) {
+        if (!quote && (*s == '\'' || *s == '"')) {
+            quote = *s++;
+        } else if (quote && *s == quote) {
+            quote = 0;
+            s++;
+        } else if (*s == '\\' && quote != '\'' && s[1]) {
+            *d++ = s[1];
+            s += 2;
+        } else {
+            *d++ = *s++;
+        }
+    }
+    if (quote) return NULL;
+    if (*s) s++;
+    *d = '\0';
+    *p = s;
+    return w;
+}
+
+/*
+    Set the options of the job from its line.
+    Return 0 if the line has a wrong option
+*/
+static int server_parse_job(char *line)
+{
+    int na = 0; // Number of appearances of flag '-a'
+    char *opt, *val;
+    argFile = envFile = inpDir = outDir = NULL;
+    while ((opt = server_next_word(&line))) {
+        val = server_next_word(&line);
+        if (!val || opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0') {
+            return 0;
+        }
+        switch (opt[1]) {
+          case 'o': outDir = val; break;
+          case 'i': inpDir = val; break;
+          case 'a': if (na==0) {argFile = val; na++; break;}
+                    if (na==1) {envFile = val; na++; break;}
+                    return 0;
+          default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Wait for jobs on the UNIX socket 'path'. This function only
+    returns in the child process forked for each job, with the
+    options of the job set and the connection as its standard
+    streams; the server itself runs until it is killed
+*/
+static void ivm_server(char *path)
+{
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(OUTPUT_MSG, "Socket name too long '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(sa.sun_path, path);
+
+    int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // Stale socket of a previous server
+    if (ls < 0 || bind(ls, (struct sockaddr*)&sa, sizeof(sa)) || listen(ls, 64)) {
+        fprintf(OUTPUT_MSG, "Can't listen on socket '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(OUTPUT_MSG, "Waiting for jobs on '%s'\n", path);
+    fflush(OUTPUT_MSG);
+
+    static char line[SERVER_MAXLINE];
+    while (1) {
+        int cs = accept(ls, NULL, NULL);
+
+        // Reap finished jobs
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+
+        if (cs < 0) continue;
+
+        // The child waits for the run (a child of its own) and sends
+        // its exit status, while the server goes on accepting jobs
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(ls);
+            pid_t run = fork();
+            if (run > 0) {
+                int status = 0;
+                while (waitpid(run, &status, 0) < 0 && errno == EINTR);
+                if (WIFSIGNALED(status)) {
+                    dprintf(cs, "Killed by signal: %d\n", WTERMSIG(status));
+                } else {
+                    dprintf(cs, "Exit status: %d\n", WEXITSTATUS(status));
+                }
+                _exit(EXIT_SUCCESS);
+            }
+            if (run < 0) {
+                dprintf(cs, "** Error in fork\n");
+                _exit(EXIT_FAILURE);
+            }
+            server_read_line(cs, line, sizeof(line));
+            dup2(cs, STDIN_FILENO);
+            dup2(cs, STDOUT_FILENO);
+            dup2(cs, STDERR_FILENO);
+            close(cs);
+            static char job[SERVER_MAXLINE];
+            strcpy(job, line); // Parsed in place
+            if (!server_parse_job(job)) {
+                fprintf(OUTPUT_MSG, "Wrong job '%s'\n", line);
+                exit(EXIT_FAILURE);
+            }
+            return;
+        }
+        if (pid < 0) {
+            fprintf(OUTPUT_MSG, "** Error in fork\n");
+            fflush(OUTPUT_MSG);
+        }
+        close(cs);
+    }
+}
+
+#endif //__IVM_EMU_SERVER_H
@@ -0,0 +1,372 @@
+/*
+ Preservation Virtual Machine Project
+
+ Yet another ivm emulator
+
+ Snapshot of the full emulator state: memory, PC, SP, probe
+ counters and I/O state, so that a run can be resumed later
+ with --restore (e.g. skipping a long initialization). The
+ memory holds host addresses (GET_PC, return addresses, heap
+ pointers...), so it is restored at the same address
+
+ Persistent cache of recoded instructions: the recodes done
+ during a run are saved at exit, and applied to the binary
+ when it is loaded again (--recode-cache <dir>)
+
+ It uses the global state of the emulator (Mem, PC, SP, ...),
+ so include it after their definition
+*/
+
+#ifndef __IVM_EMU_SNAPSHOT_H
+#define __IVM_EMU_SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000    // Linux 4.17; older kernels take it as a hint
+#endif
+
+#define SNAPSHOT_MAGIC   "IVMSNAP"
+#define SNAPSHOT_VERSION 2
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t with_io;       // The I/O state follows the memory pages
+    uint64_t config;        // Hash of the instruction set (recoded opcodes)
+    uint64_t pagesize;
+    uint64_t membytes;
+    uint64_t mem;           // Address of the memory
+    uint64_t segment_start;
+    uint64_t execStart, execEnd;
+    uint64_t argStart, argEnd;
+    uint64_t envStart, envEnd;
+    uint64_t pc, sp;        // As memory indices
+    uint64_t probe;
+    uint64_t fetchs;
+    uint64_t samples[256];  // Probe counters
+    uint64_t npages;        // Number of saved pages
+} snapshot_header_t;
+
+/*
+    Hash of the instruction set attributes. Recoded opcodes
+    depend on the patterns compiled in, so a memory image with
+    recoded instructions is only valid for an emulator with the
+    same hash
+*/
+static uint64_t ivm_insn_config_hash()
+{
+    uint64_t h = 0xcbf29ce484222325UL; // FNV-1a
+    for (int i = 0; i < 256; i++) {
+        const char *c = insn_attributes[i].name;
+        h = (h ^ (uint64_t)i) * 0x100000001b3UL;
+        h = (h ^ (uint64_t)insn_attributes[i].opbytes) * 0x100000001b3UL;
+        while (c && *c) {
+            h = (h ^ (uint8_t)*c++) * 0x100000001b3UL;
+        }
+    }
+    return h;
+}
+
+/*
+    Page 'i' of the memory must be saved if it belongs to the
+    loaded files (they may be mapped, so residency says nothing
+    about them), or if it has been touched and it is not zero
+*/
+static int snapshot_page_needed(unsigned long i, unsigned long pagesize, unsigned char *resident)
+{
+    unsigned long loadEnd = MAX(execEnd, MAX(argEnd, envEnd)) + BYTESPERWORD;
+    if (i*pagesize <= loadEnd && (i+1)*pagesize > (unsigned long)segment_start) {
+        return 1;
+    }
+    if (!(resident[i] & 1)) {
+        return 0;
+    }
+    uint64_t *p = (uint64_t*)&Mem[i*pagesize];
+    for (unsigned long k = 0; k < pagesize/sizeof(uint64_t); k++) {
+        if (p[k]) return 1;
+    }
+    return 0;
+}
+
+/*
+    Write the emulator state in 'filename'. 'pc' is the next
+    instruction to be executed. 'samples' (probe counters) may
+    be NULL if they are not counted.
+    The file is written under a temporary name and renamed, so
+    an existing snapshot is never left half written
+*/
+static void ivm_save_snapshot(char *filename, char *pc, uint64_t *samples, uint64_t fetchs, uint8_t probe)
+{
+    unsigned long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned long npages = (MemBytes + pagesize - 1)/pagesize;
+    unsigned char *resident = (unsigned char*)malloc(npages);
+    if (!resident || mincore(Mem, MemBytes, resident)) {
+        fprintf(OUTPUT_MSG, "Can't get the memory pages for the snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+
+    snapshot_header_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, SNAPSHOT_MAGIC);
+    h.version = SNAPSHOT_VERSION;
+    #ifndef NO_IO
+    h.with_io = 1;
+    #endif
+    h.config = ivm_insn_config_hash();
+    h.pagesize = pagesize;
+    h.membytes = MemBytes;
+    h.mem = (uint64_t)Mem;
+    h.segment_start = segment_start;
+    h.execStart = execStart; h.execEnd = execEnd;
+    h.argStart = argStart; h.argEnd = argEnd;
+    h.envStart = envStart; h.envEnd = envEnd;
+    h.pc = addr2idx(pc);
+    h.sp = addr2idx(SP);
+    h.probe = probe;
+    h.fetchs = fetchs;
+    if (samples) memcpy(h.samples, samples, sizeof(h.samples));
+    for (unsigned long i = 0; i < npages; i++) {
+        h.npages += snapshot_page_needed(i, pagesize, resident);
+    }
+
+    char *tmpname = (char*)malloc(strlen(filename) + 8);
+    sprintf(tmpname, "%s.tmp", filename);
+    FILE *fd = fopen(tmpname, "wb");
+    if (!fd || fwrite(&h, sizeof(h), 1, fd) < 1) {
+        fprintf(OUTPUT_MSG, "Can't write snapshot '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t i = 0; i < npages; i++) {
+        if (snapshot_page_needed(i, pagesize, resident)) {
+            if (fwrite(&i, sizeof(i), 1, fd) < 1
+             || fwrite(&Mem[i*pagesize], 1, MIN(pagesize, MemBytes - i*pagesize), fd) == 0) {
+                fprintf(OUTPUT_MSG, "Can't write snapshot '%s'\n", filename);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    #ifndef NO_IO
+    ioSaveState(fd);
+    #endif
+    if (fclose(fd) || rename(tmpname, filename)) {
+        fprintf(OUTPUT_MSG, "Can't write snapshot '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    #if (VERBOSE>0)
+        fprintf(OUTPUT_MSG, "Snapshot of %lu pages written to '%s'\n", (unsigned long)h.npages, filename);
+    #endif
+
+    free(tmpname);
+    free(resident);
+}
+
+/*
+    Restore the emulator state from 'filename'. The memory is
+    mapped again at the address it had when the snapshot was
+    taken, with its size
+*/
+static void ivm_restore_snapshot(char *filename, uint64_t *samples, uint64_t *fetchs, uint8_t *probe)
+{
+    FILE *fd = fopen(filename, "rb");
+    if (!fd){
+        fprintf(OUTPUT_MSG, "Can't open snapshot '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    snapshot_header_t h;
+    if (fread(&h, sizeof(h), 1, fd) < 1 || strcmp(h.magic, SNAPSHOT_MAGIC)
+     || h.version != SNAPSHOT_VERSION) {
+        fprintf(OUTPUT_MSG, "'%s' is not a valid snapshot\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (h.config != ivm_insn_config_hash()) {
+        fprintf(OUTPUT_MSG, "Snapshot '%s' was taken with a different emulator build\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    munmap(Mem, MemBytes);
+    MemBytes = h.membytes;
+    Mem = (char*)mmap((void*)h.mem, MemBytes, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED_NOREPLACE, -1, 0);
+    if (Mem != (char*)h.mem) {
+        fprintf(OUTPUT_MSG, "Can't map the memory of snapshot '%s' at its address %#lx\n",
+                filename, (unsigned long)h.mem);
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t k = 0; k < h.npages; k++) {
+        uint64_t i;
+        if (fread(&i, sizeof(i), 1, fd) < 1 || i*h.pagesize >= MemBytes
+         || fread(&Mem[i*h.pagesize], 1, MIN(h.pagesize, MemBytes - i*h.pagesize), fd) == 0) {
+            fprintf(OUTPUT_MSG, "Error reading snapshot '%s'\n", filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    #ifndef NO_IO
+    if (h.with_io) ioLoadState(fd);
+    #endif
+    fclose(fd);
+
+    segment_start = h.segment_start;
+    execStart = h.execStart; execEnd = h.execEnd;
+    argStart = h.argStart; argEnd = h.argEnd;
+    envStart = h.envStart; envEnd = h.envEnd;
+    PC = idx2addr(h.pc);
+    SP = idx2addr(h.sp);
+    *probe = h.probe;
+    if (fetchs) *fetchs = h.fetchs;
+    if (samples) memcpy(samples, h.samples, sizeof(h.samples));
+
+    #if (VERBOSE>0)
+        fprintf(OUTPUT_MSG, "Restored %lu pages from snapshot '%s'\n", (unsigned long)h.npages, filename);
+    #endif
+}
+
+
+/* Persistent cache of recoded instructions */
+
+#ifdef RECODE_INSN
+
+#define RECODE_CACHE_MAGIC   "IVMRCOD"
+#define RECODE_CACHE_VERSION 2
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    uint64_t key;           // Hash of the binary and the instruction set
+    uint64_t binsize;
+} recode_cache_header_t;
+
+typedef struct {
+    uint32_t offset;        // Position of the opcode from execStart
+    uint8_t  from, to;      // Opcode before and after recoding
+} recode_entry_t;
+
+recode_entry_t *recode_log = NULL; // Recodes loaded from the cache and done in this run
+unsigned long recode_log_n = 0;
+unsigned long recode_log_size = 0;
+unsigned long recode_loaded = 0;   // Entries of recode_log loaded from the cache
+uint64_t recode_key = 0;
+
+static void recode_log_add(char *pc, uint8_t from, uint8_t to)
+{
+    unsigned long i = addr2idx(pc);
+    if (i < execStart || i > execEnd) return;
+    if (recode_log_n == recode_log_size) {
+        recode_log_size = recode_log_size ? 2*recode_log_size : 4096;
+        recode_log = (recode_entry_t*)realloc(recode_log, recode_log_size*sizeof(recode_entry_t));
+        if (!recode_log) {
+            fprintf(OUTPUT_MSG, "Not enough memory for the recode cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    recode_log[recode_log_n++] = (recode_entry_t){ i - execStart, from, to };
+}
+
+/*
+    Key of the cache: hash of the identity of the binary file (device,
+    inode, size and modification time) and of the instruction set
+    configuration. The contents are not read, so a mapped binary
+    (--mmap) is still only read where it is executed; each loaded
+    entry is checked against the opcode it replaces anyway
+*/
+static uint64_t ivm_recode_key(char *binfile)
+{
+    struct stat st;
+    if (stat(binfile, &st)) return 0;
+    uint64_t id[5] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    uint64_t h = ivm_insn_config_hash();
+    for (int i = 0; i < 5; i++) {
+        h = (h ^ id[i]) * 0x100000001b3UL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static char* recode_cache_filename(char *dir, uint64_t key)
+{
+    char *fn = (char*)malloc(strlen(dir) + 32);
+    sprintf(fn, "%s/%016lx.rc", dir, key);
+    return fn;
+}
+
+/*
+    Apply the recodes cached for the binary just loaded from 'binfile'.
+    Return the number of recoded instructions
+*/
+static long ivm_recode_cache_load(char *dir, char *binfile)
+{
+    recode_key = ivm_recode_key(binfile);
+    if (!recode_key) return 0; // Nothing to save either
+    char *filename = recode_cache_filename(dir, recode_key);
+    FILE *fd = fopen(filename, "rb");
+    free(filename);
+    if (!fd) return 0;
+
+    recode_cache_header_t h;
+    if (fread(&h, sizeof(h), 1, fd) < 1 || strcmp(h.magic, RECODE_CACHE_MAGIC)
+     || h.version != RECODE_CACHE_VERSION || h.key != recode_key
+     || h.binsize != execEnd - execStart + 1) {
+        fclose(fd);
+        return 0;
+    }
+
+    // Entries are in recoding order, so an instruction recoded
+    // twice is found with its first recoded opcode
+    recode_entry_t e;
+    for (uint32_t k = 0; k < h.nentries && fread(&e, sizeof(e), 1, fd) == 1; k++) {
+        if (e.offset < h.binsize && (uint8_t)Mem[execStart + e.offset] == e.from) {
+            Mem[execStart + e.offset] = e.to;
+            recode_log_add(&Mem[execStart + e.offset], e.from, e.to);
+        }
+    }
+    fclose(fd);
+    recode_loaded = recode_log_n;
+    return recode_loaded;
+}
+
+/*
+    Save the recodes if any instruction was recoded during this run.
+    The file is written under a temporary name and renamed, so
+    concurrent runs of the same binary never see it half written
+*/
+static void ivm_recode_cache_save(char *dir)
+{
+    if (recode_log_n == recode_loaded) return;
+
+    recode_cache_header_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, RECODE_CACHE_MAGIC);
+    h.version = RECODE_CACHE_VERSION;
+    h.nentries = recode_log_n;
+    h.key = recode_key;
+    h.binsize = execEnd - execStart + 1;
+
+    char *filename = recode_cache_filename(dir, recode_key);
+    char *tmpname = (char*)malloc(strlen(filename) + 32);
+    sprintf(tmpname, "%s.%d.tmp", filename, (int)getpid());
+    FILE *fd = fopen(tmpname, "wb");
+    if (!fd || fwrite(&h, sizeof(h), 1, fd) < 1
+     || fwrite(recode_log, sizeof(recode_entry_t), recode_log_n, fd) < recode_log_n
+     || fclose(fd) || rename(tmpname, filename)) {
+        // The cache is only an optimization
+        fprintf(OUTPUT_MSG, "Can't write recode cache '%s'\n", filename);
+        unlink(tmpname);
+    }
+    #if (VERBOSE>0)
+    else {
+        fprintf(OUTPUT_MSG, "%lu recoded instructions saved to '%s'\n", recode_log_n, filename);
+    }
+    #endif
+    free(tmpname);
+    free(filename);
+}
+#endif // RECODE_INSN
+
+#endif //__IVM_EMU_SNAPSHOT_H
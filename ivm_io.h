@@ -10,7 +10,15 @@
 
 // IO instructions
 #include <png.h>
+#include <zlib.h>
 #include <dirent.h> // scandir()
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/uio.h> // vmsplice()
+#include <poll.h>
 
 #define MAX_FILENAME 260
 
@@ -24,6 +32,12 @@
 #define NOT_WRITEABLE 7
 #define PNG_TROUBLE 8
 
+// Output files written by ioOutOpen() (--out-backend)
+#include "ivm_io_async.h"
+
+// Pixel conversion kernels (gray input frames, PNG filter Sub)
+#include "ivm_io_simd.h"
+
 #if (__STDC_UTF_32__==1) //*uma: use wide char functions when possible
 // See: https://stackoverflow.com/questions/526430/c-programming-how-can-i-program-for-unicode?rq=4
 #define USE_STDC_UTF_32
@@ -50,7 +64,7 @@ static long readFile(char* filename, void* start) {
 }
 
 static void writeFile(char* filename, void* start, size_t size, int append) {
-  FILE* fileptr = fopen(filename, append?"ab":"wb");
+  FILE* fileptr = ioOutOpen(filename, append);
   if (!fileptr || fwrite(start, 1, size, fileptr) < size) {
     fprintf(stderr, "Trouble writing: %s\n", filename);
     exit(NOT_WRITEABLE);
@@ -83,7 +97,7 @@ static const WavHeader wavBasicHeader = {
 };
 
 static void writeWav(char* filename, void* start, size_t size, uint32_t sampleRate) {
-  FILE* fileptr = fopen(filename, "wb");
+  FILE* fileptr = ioOutOpen(filename, 0);
   if (!fileptr) {
     fprintf(stderr, "Trouble writing: %s\n", filename);
     exit(NOT_WRITEABLE);
@@ -101,7 +115,20 @@ static void writeWav(char* filename, void* start, size_t size, uint32_t sampleRa
   fclose(fileptr);
 }
 
+static void writePngBuiltin(char* filename, void* start, uint16_t width, uint16_t height, int level);
+static int pngBands(uint16_t width, uint16_t height);
+
 static void writePng(char* filename, void* start, uint16_t width, uint16_t height) {
+  if (opt_png == PNG_BUILTIN) {
+    writePngBuiltin(filename, start, width, height, Z_BEST_SPEED);
+    return;
+  }
+  if (pngBands(width, height) > 1) { // Large frame, compressed by several threads
+    int level = opt_png == PNG_FAST ? Z_BEST_SPEED
+              : opt_png == PNG_STORE ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION;
+    writePngBuiltin(filename, start, width, height, level);
+    return;
+  }
   png_structp png;
   png_infop info;
   if (!(png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL))
@@ -109,7 +136,7 @@ static void writePng(char* filename, void* start, uint16_t width, uint16_t heigh
   || setjmp(png_jmpbuf(png))) {
     exit(PNG_TROUBLE);
   }
-  FILE *fileptr = fopen(filename, "wb");
+  FILE *fileptr = ioOutOpen(filename, 0);
   if (!fileptr) {
     fprintf(stderr, "Trouble writing: %s\n", filename);
     exit(NOT_WRITEABLE);
@@ -125,6 +152,13 @@ static void writePng(char* filename, void* start, uint16_t width, uint16_t heigh
     PNG_COMPRESSION_TYPE_DEFAULT,
     PNG_FILTER_TYPE_DEFAULT
   );
+  if (opt_png == PNG_FAST) {
+    png_set_compression_level(png, Z_BEST_SPEED);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+  } else if (opt_png == PNG_STORE) {
+    png_set_compression_level(png, Z_NO_COMPRESSION);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+  }
   png_write_info(png, info);
   for (int y = 0; y < height; y++) {
     png_write_row(png, start + y * width * 3);
@@ -158,6 +192,196 @@ static void spaceReset(Space* s, size_t needed) {
 }
 
 
+/*
+  Built-in PNG encoder (--png builtin): one pass over the image,
+  filter Sub on every row and zlib deflate with its fastest settings,
+  without the per-row machinery of libpng.
+  With --png-threads N, a large frame (of any profile) is split into
+  up to N bands of rows, deflated by as many threads into independent
+  raw deflate blocks (pigz-style: each band but the last ends with a
+  sync flush, so the blocks can be concatenated) and stitched into a
+  single zlib stream, with the checksum of the whole from those of the
+  bands
+*/
+#define PNG_MAX_BANDS  64
+#define PNG_BAND_BYTES 0x100000   // Smallest band worth a thread (1 MiB)
+
+static void pngWriteChunk(FILE* fileptr, const char* type, const uint8_t* data, uint32_t len) {
+  uint8_t head[8] = {len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3]};
+  uint32_t crc = crc32(0, head + 4, 4);
+  if (len > 0) crc = crc32(crc, data, len);
+  uint8_t tail[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+  if (fwrite(head, 1, 8, fileptr) < 8 || fwrite(data, 1, len, fileptr) < len
+  || fwrite(tail, 1, 4, fileptr) < 4) {
+    exit(NOT_WRITEABLE);
+  }
+}
+
+// Filter a row: Sub (each byte minus the same color of the previous pixel),
+// or None when not compressing
+static void pngFilterRow(uint8_t* r, const uint8_t* p, size_t rowbytes, int level) {
+  if (level == Z_NO_COMPRESSION) {
+    r[0] = 0;
+    memcpy(r + 1, p, rowbytes);
+    return;
+  }
+  r[0] = 1;
+  pngSub(r + 1, p, rowbytes);
+}
+
+// Number of bands in which a frame is compressed (1: not split)
+static int pngBands(uint16_t width, uint16_t height) {
+  size_t size = (3 * (size_t)width + 1) * height;
+  int n = opt_png_threads < PNG_MAX_BANDS ? opt_png_threads : PNG_MAX_BANDS;
+  if ((size_t)n > size / PNG_BAND_BYTES) n = size / PNG_BAND_BYTES;
+  if (n > height) n = height;
+  return n > 1 ? n : 1;
+}
+
+typedef struct {
+  const uint8_t* image;
+  size_t rowbytes;
+  int rows;          // Rows of the band, starting at 'image'
+  int level;
+  int last;          // Last band: ends the deflate stream
+  Space* in;         // Filtered rows
+  Space* out;        // Raw deflate blocks
+  size_t size;       // Bytes in 'out' (0 on error)
+  uLong adler;       // Checksum of the filtered rows
+} PngBand;
+
+static void* pngDeflateBand(void* arg) {
+  PngBand* b = arg;
+  size_t len = (b->rowbytes + 1) * b->rows;
+  spaceReset(b->in, len);
+  for (int y = 0; y < b->rows; y++) {
+    pngFilterRow((uint8_t*)b->in->array + y * (b->rowbytes + 1), b->image + y * b->rowbytes,
+                 b->rowbytes, b->level);
+  }
+  b->adler = adler32(adler32(0, NULL, 0), b->in->array, len);
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  b->size = 0;
+  if (deflateInit2(&z, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+  spaceReset(b->out, deflateBound(&z, len) + 16); // Room for the sync flush marker
+  z.next_in = b->in->array;
+  z.avail_in = len;
+  z.next_out = b->out->array;
+  z.avail_out = b->out->size;
+  int ret = deflate(&z, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if ((b->last && ret == Z_STREAM_END) || (!b->last && ret == Z_OK && z.avail_in == 0 && z.avail_out > 0)) {
+    b->size = z.total_out;
+  }
+  deflateEnd(&z);
+  return NULL;
+}
+
+// Compress the image split into n bands; return the size of the zlib stream in 'out'
+static size_t pngDeflateBands(Space* out, const uint8_t* image, size_t rowbytes, uint16_t height,
+                              int level, int n) {
+  // Buffers kept from frame to frame (one set per output thread)
+  static __thread Space in[PNG_MAX_BANDS], bandOut[PNG_MAX_BANDS];
+  PngBand bands[PNG_MAX_BANDS];
+  pthread_t threads[PNG_MAX_BANDS];
+  int started[PNG_MAX_BANDS] = {0};
+  for (int k = 0, y = 0; k < n; k++) {
+    int rows = height / n + (k < height % n);
+    bands[k] = (PngBand){image + y * rowbytes, rowbytes, rows, level, k == n - 1,
+                         &in[k], &bandOut[k], 0, 0};
+    y += rows;
+  }
+  // The calling thread compresses the first band
+  for (int k = 1; k < n; k++) {
+    started[k] = !pthread_create(&threads[k], NULL, pngDeflateBand, &bands[k]);
+  }
+  pngDeflateBand(&bands[0]);
+  size_t total = 6;
+  for (int k = 1; k < n; k++) {
+    if (started[k]) pthread_join(threads[k], NULL);
+    else pngDeflateBand(&bands[k]);
+  }
+  for (int k = 0; k < n; k++) {
+    if (bands[k].size == 0) exit(PNG_TROUBLE);
+    total += bands[k].size;
+  }
+
+  // zlib header, the blocks of all the bands and the checksum
+  spaceReset(out, total);
+  uint8_t* o = out->array;
+  *o++ = 0x78; // Deflate, 32K window
+  *o++ = level == Z_DEFAULT_COMPRESSION ? 0x9c : 0x01;
+  uLong adler = bands[0].adler;
+  for (int k = 0; k < n; k++) {
+    memcpy(o, bands[k].out->array, bands[k].size);
+    o += bands[k].size;
+    if (k > 0) adler = adler32_combine(adler, bands[k].adler, (bands[k].rowbytes + 1) * bands[k].rows);
+  }
+  *o++ = adler >> 24; *o++ = adler >> 16; *o++ = adler >> 8; *o++ = adler;
+  return total;
+}
+
+// Filter and compress an RGB image into a zlib stream in 'out'; return its size
+static size_t pngDeflate(Space* out, const uint8_t* image, uint16_t width, uint16_t height, int level) {
+  static __thread Space row;
+  size_t rowbytes = 3 * (size_t)width;
+  int n = pngBands(width, height);
+  if (n > 1) {
+    return pngDeflateBands(out, image, rowbytes, height, level, n);
+  }
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    exit(PNG_TROUBLE);
+  }
+  spaceReset(&row, rowbytes + 1);
+  spaceReset(out, deflateBound(&z, (rowbytes + 1) * height));
+  z.next_out = out->array;
+  z.avail_out = out->size;
+
+  int ret = Z_OK;
+  for (int y = 0; y < height; y++) {
+    pngFilterRow(row.array, image + y * rowbytes, rowbytes, level);
+    z.next_in = row.array;
+    z.avail_in = rowbytes + 1;
+    ret = deflate(&z, (y == height - 1) ? Z_FINISH : Z_NO_FLUSH);
+  }
+  if (height == 0) ret = deflate(&z, Z_FINISH);
+  if (ret != Z_STREAM_END) {
+    exit(PNG_TROUBLE);
+  }
+  size_t zsize = z.total_out;
+  deflateEnd(&z);
+  return zsize;
+}
+
+static const uint8_t pngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+static void writePngBuiltin(char* filename, void* start, uint16_t width, uint16_t height, int level) {
+  // Buffer kept from frame to frame (one per output thread)
+  static __thread Space out;
+  size_t zsize = pngDeflate(&out, start, width, height, level);
+
+  FILE *fileptr = ioOutOpen(filename, 0);
+  if (!fileptr) {
+    fprintf(stderr, "Trouble writing: %s\n", filename);
+    exit(NOT_WRITEABLE);
+  }
+  uint8_t ihdr[13] = {0, 0, width >> 8, width, 0, 0, height >> 8, height,
+                      8, 2, 0, 0, 0}; // 8-bit RGB, no interlace
+  if (fwrite(pngSignature, 1, 8, fileptr) < 8) exit(NOT_WRITEABLE);
+  pngWriteChunk(fileptr, "IHDR", ihdr, sizeof(ihdr));
+  for (size_t k = 0; k < zsize; k += 0x40000000) { // Chunks up to 1 GiB
+    size_t len = zsize - k < 0x40000000 ? zsize - k : 0x40000000;
+    pngWriteChunk(fileptr, "IDAT", (uint8_t*)out.array + k, len);
+  }
+  pngWriteChunk(fileptr, "IEND", NULL, 0);
+  fclose(fileptr);
+}
+
+
 /* Growing byte buffer */
 
 typedef struct {
@@ -187,16 +411,6 @@ static void bytesPutByte(Bytes* b, uint8_t x) {
 }
 
 
-//*uma
-#ifdef USE_STDC_UTF_32
-#include <wchar.h>
-static uint32_t ioReadChar()
-{
-    uint32_t res = getwchar();
-    if (res == WEOF) res = 4;
-    return res;
-}
-#else
 // UTF-32 to UTF-8
 static void bytesPutChar(Bytes* b, uint32_t c) {
   if (c < 0x80) {
@@ -222,7 +436,7 @@ static void bytesPutChar(Bytes* b, uint32_t c) {
 
 // Read UTF-32 character, assuming UTF-8 input.
 // NB. Actual EOF is converted into the EOF character (^D).
-static uint32_t ioReadChar() {
+static uint32_t ioReadCharUtf8() {
   const uint32_t eof = (uint32_t) 4;
   int c0 = getc(stdin);
   if (c0 == EOF) return eof;
@@ -244,6 +458,23 @@ static uint32_t ioReadChar() {
   uint32_t u3 = (uint32_t) (c3 & 0x3f);
   return (u0 << 18) + (u1 << 12) + (u2 << 6) + u3;
 }
+
+static int stdinCookie = 0; // stdin replaced by a stream that cannot be wide (--bytes-out)
+
+//*uma
+#ifdef USE_STDC_UTF_32
+#include <wchar.h>
+static uint32_t ioReadChar()
+{
+    if (stdinCookie) return ioReadCharUtf8();
+    uint32_t res = getwchar();
+    if (res == WEOF) res = 4;
+    return res;
+}
+#else
+static uint32_t ioReadChar() {
+  return ioReadCharUtf8();
+}
 #endif
 
 static void bytesPutSample(Bytes* b, uint16_t left, uint16_t right) {
@@ -260,63 +491,126 @@ static void bytesPutSample(Bytes* b, uint16_t left, uint16_t right) {
 // 16 MiB
 #define INITIAL_IN_IMG_SIZE 0x1000000
 
-static struct dirent** inpFiles;
-static int numInpFiles;
+static struct dirent** inpFiles = NULL;
+static int numInpFiles = 0;
+static struct timespec inpMtime;   // Modification time of inpDir when scanned
+static int inpIsOutDir = 0;        // New frames may appear at any moment
 static Space currentInImage;
 static size_t currentInRowbytes = 0;
-static Space currentInRowpointers;
 
-static int acceptPng(const struct dirent* entry) {
-  char* ext;
-  return (entry->d_type == DT_REG)
-    && (ext = strrchr(entry->d_name, '.'))
-    && strcmp(ext, ".png") == 0;
+// Formats of the input frames, by extension
+#define IN_NONE 0
+#define IN_PNG  1
+#define IN_PGM  2  // Binary PGM (P5), 8-bit
+#define IN_PPM  3  // Binary PPM (P6), 8-bit
+#define IN_GRAY 4  // Raw gray bytes, with the size in a sidecar .size file
+
+static int ioFrameType(const char* name) {
+  static const char* exts[] = {".png", ".pgm", ".ppm", ".gray"};
+  char* ext = strrchr(name, '.');
+  for (int k = 0; ext && k < 4; k++) {
+    if (strcmp(ext, exts[k]) == 0) return IN_PNG + k;
+  }
+  return IN_NONE;
 }
 
-static void ioInitIn() {
-  numInpFiles = inpDir ? scandir(inpDir, &inpFiles, acceptPng, alphasort) : 0;
+static int acceptFrame(const struct dirent* entry) {
+  return (entry->d_type == DT_REG) && ioFrameType(entry->d_name) != IN_NONE;
+}
+
+/*
+  Index of the input directory: it is only scanned again if the
+  directory has been modified (or if it is also the output directory)
+*/
+static void ioScanInput() {
+  struct stat st;
+  if (!inpDir) return;
+  if (inpIsOutDir) ioWaitAsync(); // Frames still being written must be seen
+  if (stat(inpDir, &st) != 0) {
+    memset(&st, 0, sizeof(st)); // Scanned again (and next time too): scandir() tells the error
+  } else if (inpFiles && !inpIsOutDir
+  && st.st_mtim.tv_sec == inpMtime.tv_sec && st.st_mtim.tv_nsec == inpMtime.tv_nsec) {
+    return;
+  }
+  for (int k = 0; k < numInpFiles; k++) {
+    free(inpFiles[k]);
+  }
+  free(inpFiles);
+  inpMtime = st.st_mtim;
+  numInpFiles = scandir(inpDir, &inpFiles, acceptFrame, alphasort);
   if (numInpFiles < 0) {
     perror("scandir");
     exit(NOT_READABLE);
   }
-  spaceInit(&currentInImage);
-  spaceInit(&currentInRowpointers);
 }
 
-static void ioReadFrame(uint64_t i, uint64_t* width, uint64_t* height) {
-  /*uma: if inpDir is the same as outDir, update numImpFiles because 
-         new frames could have been generated*/
-  //if (inpDir && outDir && !strcmp(inpDir, outDir)){
-      numInpFiles = inpDir ? scandir(inpDir, &inpFiles, acceptPng, alphasort) : 0;
-  //}
-  if (i >= numInpFiles) {
-    *width = 0;
-    *height = 0;
-    return;
-  }
-  static char filename[MAX_FILENAME];
-  struct dirent* f = inpFiles[i];
-  sprintf(filename, "%s/%s", inpDir, f->d_name);
-
+/*
+  Decode a PNG file into 'image' (grayscale, rows of 'rowbytes' bytes).
+  Return 0 if it is not a readable PNG file
+*/
+static int ioDecodePng(char* filename, Space* image, size_t* rowbytes,
+                       uint64_t* width, uint64_t* height, struct timespec* mtime) {
+  static __thread Space rowpointers;
   FILE *fileptr;
-  png_structp png;
-  png_infop info;
-  if (!(fileptr = fopen(filename, "rb"))
-  || !(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL))
+  struct stat st;
+  png_structp png = NULL;
+  png_infop info = NULL;
+  if (!(fileptr = fopen(filename, "rb"))) {
+    return 0;
+  }
+  if (fstat(fileno(fileptr), &st) == 0) {
+    *mtime = st.st_mtim;
+  }
+  if (!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL))
   || !(info = png_create_info_struct(png))
   || setjmp(png_jmpbuf(png))) {
-    perror("png");
-    exit(NOT_READABLE);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fileptr);
+    return 0;
   }
   png_init_io(png, fileptr);
   png_read_info(png, info);
   *width = png_get_image_width(png, info);
   *height = png_get_image_height(png, info);
 
+  png_byte color_type = png_get_color_type(png, info);
+
+  /*
+    8-bit RGB, RGBA and gray+alpha frames are read as they are and
+    converted by the kernels of ivm_io_simd.h. Others (16-bit, interlaced,
+    or with gamma/chromaticity chunks, which change libpng's conversion)
+    are left to the libpng transforms
+  */
+  int channels = 0;
+  if (png_get_bit_depth(png, info) == 8
+  && png_get_interlace_type(png, info) == PNG_INTERLACE_NONE
+  && !png_get_valid(png, info, PNG_INFO_gAMA | PNG_INFO_sRGB | PNG_INFO_cHRM | PNG_INFO_iCCP)) {
+    channels = color_type == PNG_COLOR_TYPE_RGB ? 3
+             : color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4
+             : color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 0;
+  }
+  if (channels) {
+    static __thread Space row;
+    *rowbytes = *width;
+    spaceReset(image, *rowbytes * *height);
+    spaceReset(&row, *width * channels);
+    for (size_t y = 0; y < *height; y++) {
+      png_read_row(png, row.array, NULL);
+      uint8_t* g = (uint8_t*)image->array + *rowbytes * y;
+      if (channels == 2) {
+        gaToGray(g, row.array, *width);
+      } else {
+        rgbToGray(g, row.array, *width, channels);
+      }
+    }
+    fclose(fileptr);
+    png_destroy_read_struct(&png, &info, NULL);
+    return 1;
+  }
+
   if (png_get_bit_depth(png, info) == 16) {
     png_set_strip_16(png);
   }
-  png_byte color_type = png_get_color_type(png, info);
   if (color_type == PNG_COLOR_TYPE_RGB ||
       color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
     png_set_rgb_to_gray(png, 1, -1.0, -1.0); // Default weights
@@ -325,162 +619,1665 @@ static void ioReadFrame(uint64_t i, uint64_t* width, uint64_t* height) {
     png_set_strip_alpha(png);
   }
   png_read_update_info(png, info);
-  size_t rowbytes = png_get_rowbytes(png, info);
-  size_t needed = rowbytes * *height;
-
-  // We have attempted to optimize for the expected case
-  // when all the inp frames have the same format.
+  *rowbytes = png_get_rowbytes(png, info);
+  size_t needed = *rowbytes * *height;
 
-  if (needed > currentInImage.size) {
-    spaceReset(&currentInImage, needed);
-    currentInRowbytes = 0;
+  spaceReset(image, needed);
+  spaceReset(&rowpointers, sizeof(void*) * *height);
+  void** rp = rowpointers.array;
+  for (int y = 0; y < *height; y++) {
+    rp[y] = image->array + *rowbytes * y;
   }
-  //*uma: fixed bug
-  if (*height * sizeof(void*) > currentInRowpointers.size) {
-    spaceReset(&currentInRowpointers, sizeof(void*) * *height);
-    currentInRowbytes = 0;
-  }
-  if (rowbytes != currentInRowbytes) {
-    void** rp = currentInRowpointers.array;
-    for (int y = 0; y < *height; y++) {
-      rp[y] = currentInImage.array + rowbytes * y;
-    }
-    currentInRowbytes = rowbytes;
-  }
-
 
-  png_read_image(png, currentInRowpointers.array);
+  png_read_image(png, rowpointers.array);
   fclose(fileptr);
   png_destroy_read_struct(&png, &info, NULL);
+  return 1;
 }
 
-static uint8_t ioReadPixel(uint16_t x, uint16_t y) {
-  return *((uint8_t*) currentInImage.array + currentInRowbytes * y + x);
-}
+/*
+  Prefetch (--prefetch N): a thread decodes the next N input frames
+  while the program works on the current one. A prefetched frame is
+  handed over by swapping its buffer with the current one.
+
+  Cache (--in-cache <bytes>): the decoded frames are kept, up to that
+  many bytes (least recently used ones are dropped first), and the
+  current frame is read from its entry in the cache, so reading again
+  a cached frame costs no decoding nor copy. Entries are checked
+  against the modification time of their files
+*/
 
+typedef struct {
+  char name[MAX_FILENAME];   // File name, "" if the slot is free
+  int state;
+  Space image;
+  size_t rowbytes;
+  uint64_t width, height;
+  struct timespec mtime;     // Of the file when it was decoded
+  uint64_t lastUse;          // For the LRU replacement of the cache
+} InFrame;
 
-/* Output state */
+#define IN_FREE     0
+#define IN_QUEUED   1
+#define IN_DECODING 2
+#define IN_READY    3
+#define IN_FAILED   4
 
-// 16 MiB
-#define INITIAL_TEXT_SIZE    0x1000000
-#define INITIAL_BYTES_SIZE   0x1000000
-#define INITIAL_SAMPLES_SIZE 0x1000000
-#define INITIAL_OUT_IMG_SIZE 0x1000000
+static InFrame** inFrames = NULL;  // Prefetched and cached frames (entries never move)
+static int inNumFrames = 0;
+static int inPrefetchOn = 0;
+static InFrame* inCurrent = NULL;  // Cached frame being read
+static size_t inCacheBytes = 0;    // Bytes of the cached frames
+static uint64_t inClock = 0;
+static uint8_t* currentInPixels = NULL;  // Pixels of the current input frame
+static size_t currentInSize = 0;
+static pthread_t inThread;
+static pthread_mutex_t inLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inWork = PTHREAD_COND_INITIALIZER;   // A frame queued
+static pthread_cond_t inDone = PTHREAD_COND_INITIALIZER;   // A frame decoded
 
-static int outputCounter = 0;
-static Bytes currentText;
-static Bytes currentBytes;
-static Bytes currentSamples;
-static uint32_t currentSampleRate;
-static Space currentOutImage;
-static uint16_t currentOutWidth;
-static uint16_t currentOutHeight;
+static void ioEvictFrames();
 
-static void ioInitOut() {
-  if (outDir) {
-    if (strlen(outDir) + 16 > MAX_FILENAME) {
-      exit(STRING_TOO_LONG);
+static void* ioPrefetcher(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&inLock);
+  while (1) {
+    InFrame* f = NULL;
+    for (int k = 0; k < inNumFrames && !f; k++) {
+      if (inFrames[k]->state == IN_QUEUED) f = inFrames[k];
     }
+    if (!f) {
+      pthread_cond_wait(&inWork, &inLock);
+      continue;
+    }
+    f->state = IN_DECODING;
+    pthread_mutex_unlock(&inLock);
+    int ok = ioDecodePng(f->name, &f->image, &f->rowbytes, &f->width, &f->height, &f->mtime);
+    pthread_mutex_lock(&inLock);
+    f->state = ok ? IN_READY : IN_FAILED;
+    if (ok && opt_in_cache) {
+      inCacheBytes += f->image.used;
+      ioEvictFrames(); // The budget holds between READ_FRAMEs too
+    }
+    pthread_cond_broadcast(&inDone);
   }
-  bytesInit(&currentText, INITIAL_TEXT_SIZE);
-  bytesInit(&currentBytes, INITIAL_BYTES_SIZE);
-  bytesInit(&currentSamples, INITIAL_SAMPLES_SIZE);
-  spaceInit(&currentOutImage);
+  return NULL;
 }
 
-static void ioFlush_console() {  //*uma: flush current cumulative text without increasing frame number
-  static int outputCounter_cur = -1;
-  if (outDir) {
-    static char filename[MAX_FILENAME];
-    char* ext = filename + sprintf(filename, "%s/%08d.", outDir, outputCounter);
+// The functions below are called with inLock held
 
-    int append = outputCounter_cur == outputCounter;
+static InFrame* ioFindFrame(char* name) {
+  for (int k = 0; k < inNumFrames; k++) {
+    if (inFrames[k]->state != IN_FREE && !strcmp(inFrames[k]->name, name)) return inFrames[k];
+  }
+  return NULL;
+}
 
-    if (currentText.used > 0) {
-      sprintf(ext, "text");
-      writeFile(filename, currentText.array, currentText.used, append);
+static InFrame* ioNewFrameEntry(char* name, int state) {
+  InFrame* f = NULL;
+  for (int k = 0; k < inNumFrames && !f; k++) {
+    if (inFrames[k]->state == IN_FREE) f = inFrames[k];
+  }
+  if (!f) {
+    inFrames = realloc(inFrames, (inNumFrames + 1) * sizeof(InFrame*));
+    f = calloc(1, sizeof(InFrame));
+    if (!inFrames || !f) exit(OUT_OF_MEMORY);
+    inFrames[inNumFrames++] = f;
+  }
+  strcpy(f->name, name);
+  f->state = state;
+  f->lastUse = ++inClock;
+  return f;
+}
+
+static void ioDropFrame(InFrame* f) {
+  if (opt_in_cache || f->state == IN_FAILED) {
+    // Cached and failed frames give their memory back
+    if (f->state == IN_READY) inCacheBytes -= f->image.used;
+    free(f->image.array);
+    spaceInit(&f->image);
+  }
+  f->state = IN_FREE;
+}
+
+// Drop the least recently used frames beyond the memory budget
+static void ioEvictFrames() {
+  while (inCacheBytes > opt_in_cache) {
+    InFrame* lru = NULL;
+    for (int k = 0; k < inNumFrames; k++) {
+      InFrame* f = inFrames[k];
+      if (f->state == IN_READY && f != inCurrent && (!lru || f->lastUse < lru->lastUse)) lru = f;
     }
-    if (currentBytes.used > 0) {
-      sprintf(ext, "bytes");
-      writeFile(filename, currentBytes.array, currentBytes.used, append);
+    if (!lru) break;
+    ioDropFrame(lru);
+  }
+}
+
+// Queue the frames that follow frame 'i'
+static void ioPrefetch(uint64_t i) {
+  static char filename[MAX_FILENAME];
+  int queued = 0;
+  for (int k = 0; k < inNumFrames; k++) {
+    InFrame* f = inFrames[k];
+    if (f->state == IN_FAILED) ioDropFrame(f);
+    if (f->state == IN_READY && !opt_in_cache) {
+      // Without cache, frames no longer in the window are recycled
+      int keep = 0;
+      for (uint64_t j = i + 1; j <= i + opt_prefetch && j < (uint64_t)numInpFiles && !keep; j++) {
+        sprintf(filename, "%s/%s", inpDir, inpFiles[j]->d_name);
+        keep = !strcmp(f->name, filename);
+      }
+      if (!keep) f->state = IN_FREE;
     }
   }
-  currentText.used = 0;
-  currentBytes.used = 0;
-  outputCounter_cur = outputCounter;
+  for (uint64_t j = i + 1; j <= i + opt_prefetch && j < (uint64_t)numInpFiles; j++) {
+    if (ioFrameType(inpFiles[j]->d_name) != IN_PNG) continue; // Mapped when read
+    sprintf(filename, "%s/%s", inpDir, inpFiles[j]->d_name);
+    if (ioFindFrame(filename)) continue;
+    ioNewFrameEntry(filename, IN_QUEUED);
+    queued = 1;
+  }
+  if (queued) pthread_cond_signal(&inWork);
 }
 
-static void ioFlush() {
-  if (outDir) {
-    static char filename[MAX_FILENAME];
-    char* ext = filename + sprintf(filename, "%s/%08d.", outDir, outputCounter);
-    //~ if (currentText.used > 0) {
-    //~   sprintf(ext, "text");
-    //~   //writeFile(filename, currentText.array, currentText.used);
-    //~   writeFile_append(filename, currentText.array, currentText.used); //*uma
-    //~ }
-    //~ if (currentBytes.used > 0) {
-    //~   sprintf(ext, "bytes");
-    //~   //writeFile(filename, currentBytes.array, currentBytes.used);
-    //~   writeFile_append(filename, currentBytes.array, currentBytes.used); //*uma
-    //~ }
+/*
+  Uncompressed input frames (PGM, PPM and raw gray) need no decoding.
+  Gray ones are mapped: their pixels are read from the page cache with
+  no copy until the next frame is read. PPM frames are converted to
+  gray with the weights libpng uses for PNG frames
+*/
+static void* inMap = NULL;           // Mapping of the current input frame
+static size_t inMapSize = 0;
 
-    ioFlush_console(); //*uma
+static void ioUnmapFrame() {
+  if (inMap) munmap(inMap, inMapSize);
+  inMap = NULL;
+}
 
-    if (currentSamples.used > 0) {
-      sprintf(ext, "wav");
-      writeWav(filename, currentSamples.array, currentSamples.used, currentSampleRate);
-    }
-    if (currentOutImage.used > 0) {
-      sprintf(ext, "png");
-      writePng(filename, currentOutImage.array, currentOutWidth, currentOutHeight);
+// Parse the header of a PGM/PPM file; return the offset of the pixels (0 if wrong)
+static size_t pnmHeader(const uint8_t* p, size_t size, char magic, uint64_t* width, uint64_t* height) {
+  uint64_t v[3];
+  size_t pos = 2;
+  if (size < 2 || p[0] != 'P' || p[1] != magic) return 0;
+  for (int k = 0; k < 3; k++) {
+    while (pos < size && (isspace(p[pos]) || p[pos] == '#')) {
+      if (p[pos] == '#') while (pos < size && p[pos] != '\n') pos++;
+      else pos++;
     }
+    if (pos >= size || !isdigit(p[pos])) return 0;
+    for (v[k] = 0; pos < size && isdigit(p[pos]); pos++) v[k] = 10 * v[k] + (p[pos] - '0');
   }
-  currentText.used = 0;
-  currentBytes.used = 0;
-  currentSamples.used = 0;
-  currentOutImage.used = 0;
-  outputCounter++;
+  if (pos >= size || !isspace(p[pos]) || v[2] == 0 || v[2] > 255) return 0;
+  *width = v[0];
+  *height = v[1];
+  return pos + 1; // A single white space before the pixels
 }
 
+// Make an uncompressed file the current input frame; return 0 on error
+static int ioMapFrame(char* filename, int type, uint64_t* width, uint64_t* height) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  uint8_t* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
 
-static void ioPutChar(uint32_t c) {
-  int start = currentText.used;
-#ifdef USE_STDC_UTF_32
-  currentText.used += snprintf((char*)&currentText.array[start], 5, "%lc", c);
-  fputwc((wchar_t)c, stderr); //*uma: put_char to stderr as "ivm run" does
-#else
-  bytesPutChar(&currentText, c);
-  int len = currentText.used - start;
-  //printf("%.*s", len, currentText.array + start); //original
-  fprintf(stderr, "%.*s", len, currentText.array + start); //*uma: put_char to stderr as "ivm run" does
-#endif
-  if (currentText.used + 5 > INITIAL_TEXT_SIZE){ //*uma: flush console if buffer exhausted
-    ioFlush_console();
+  size_t offset = 0, channels = 1;
+  uint64_t w = 0, h = 0;
+  if (type == IN_GRAY) {
+    // Size in "<name>.size": width and height
+    char sizename[MAX_FILENAME + 8];
+    strcpy(sizename, filename);
+    strcpy(strrchr(sizename, '.'), ".size");
+    FILE* f = fopen(sizename, "r");
+    if (!f || fscanf(f, "%lu %lu", &w, &h) != 2) w = 0;
+    if (f) fclose(f);
+  } else {
+    channels = type == IN_PPM ? 3 : 1;
+    offset = pnmHeader(map, st.st_size, type == IN_PPM ? '6' : '5', &w, &h);
+  }
+  if (w == 0 || w > 0xffff || h > 0xffff || (type != IN_GRAY && offset == 0)
+  || st.st_size - offset < w * h * channels) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return 0;
+  }
+
+  ioUnmapFrame();
+  if (type == IN_PPM) {
+    spaceReset(&currentInImage, w * h);
+    rgbToGray(currentInImage.array, map + offset, w * h, 3);
+    munmap(map, st.st_size);
+    currentInPixels = currentInImage.array;
+  } else {
+    madvise(map, st.st_size, MADV_WILLNEED);
+    inMap = map;
+    inMapSize = st.st_size;
+    currentInPixels = map + offset;
   }
+  inCurrent = NULL;
+  currentInRowbytes = w;
+  currentInSize = w * h;
+  *width = w;
+  *height = h;
+  return 1;
 }
 
-static void ioPutByte(uint8_t x) {
-  bytesPutByte(&currentBytes, x);
-  if (currentBytes.used >= INITIAL_BYTES_SIZE){ //*uma: flush console if buffer exhausted
-    ioFlush_console();
+
+/*
+  Chained stages (--chain, see ivm_emu_chain.h): the images of a stage
+  are handed to the next one through a pipe instead of PNG files. They
+  are sent already converted to gray, as READ_FRAME would decode them,
+  each one as its width and height (uint32_t) followed by its pixels.
+  The next stage only reads the pipe up to the frames it asks for, so
+  a stage that is ahead waits on it. READ_FRAME may ask again for any
+  frame received: the least recently used ones beyond the memory of
+  --chain-cache (CHAIN_CACHE by default) go to a temporary file, and
+  are read back from it when needed
+*/
+#define CHAIN_CACHE (64UL << 20)
+
+static int chainOutFd = -1;        // Pipe to the next stage
+static int chainInFd = -1;         // Pipe from the previous stage
+static int chainInEnded = 0;       // All its frames received
+
+typedef struct {
+  Space image;                     // Pixels, if in memory
+  uint32_t width;
+  uint32_t height;
+  off_t spilled;                   // Offset in the temporary file, or -1
+  uint64_t lastUse;
+} ChainFrame;
+
+static ChainFrame* chainFrames = NULL;
+static uint64_t chainNumFrames = 0;
+static uint64_t* chainResident = NULL;  // Frames in memory
+static uint64_t chainNumResident = 0;
+static size_t chainBytes = 0;           // Pixels of the frames in memory
+static uint64_t chainClock = 0;
+static uint64_t chainCurrent = UINT64_MAX;  // Frame being read
+static int chainSpillFd = -1;           // Temporary file of the frames out of memory
+static off_t chainSpillEnd = 0;
+
+static int readAll(int fd, void* start, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, (uint8_t*)start + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
   }
+  return 1;
 }
 
-static void ioAddSample(uint16_t left, uint16_t right) {
-  bytesPutSample(&currentSamples, left, right);
+// Whole pixels of a frame to or from the temporary file at 'offset'
+static int spillAll(int write, uint8_t* start, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write ? pwrite(chainSpillFd, start + done, size - done, offset + done)
+                      : pread(chainSpillFd, start + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
 }
 
-static void ioNewFrame(uint16_t width, uint16_t height, uint32_t sampleRate) {
-  currentSampleRate = sampleRate;
-  currentOutWidth = width;
-  currentOutHeight = height;
-  spaceReset(&currentOutImage, 3 * width * height);
+static void ioChainResident(uint64_t i) {
+  if ((chainNumResident & (chainNumResident + 1)) == 0) { // 0, 1, 3, 7...: grow to 1, 2, 4, 8...
+    chainResident = realloc(chainResident, 2 * (chainNumResident + 1) * sizeof(uint64_t));
+    if (!chainResident) exit(OUT_OF_MEMORY);
+  }
+  chainResident[chainNumResident++] = i;
+  chainBytes += chainFrames[i].image.used;
 }
 
-static void ioSetPixel(uint16_t x, uint16_t y, uint64_t r, uint64_t g, uint64_t b) {
-  uint8_t* p = currentOutImage.array + (y * currentOutWidth + x) * 3;
-  p[0] = (uint8_t) r;
-  p[1] = (uint8_t) g;
-  p[2] = (uint8_t) b;
+// Move the least recently used frames beyond the memory budget to the temporary file
+static void ioChainEvict() {
+  size_t budget = opt_chain_cache ? opt_chain_cache : CHAIN_CACHE;
+  while (chainBytes > budget) {
+    uint64_t lru = 0;
+    int found = 0;
+    for (uint64_t k = 0; k < chainNumResident; k++) {
+      uint64_t i = chainResident[k];
+      if (i != chainCurrent && (!found || chainFrames[i].lastUse < chainFrames[chainResident[lru]].lastUse)) {
+        lru = k;
+        found = 1;
+      }
+    }
+    if (!found) break;
+    ChainFrame* f = &chainFrames[chainResident[lru]];
+    if (f->spilled < 0) {
+      if (chainSpillFd < 0) { // Unlinked at once: it goes away with the stage
+        static char name[MAX_FILENAME];
+        snprintf(name, MAX_FILENAME, "%s/ivm64-chain-XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+        chainSpillFd = mkstemp(name);
+        if (chainSpillFd < 0) {
+          perror(name);
+          exit(NOT_WRITEABLE);
+        }
+        unlink(name);
+      }
+      if (!spillAll(1, f->image.array, f->image.used, chainSpillEnd)) {
+        perror("Temporary file of the chain");
+        exit(NOT_WRITEABLE);
+      }
+      f->spilled = chainSpillEnd;
+      chainSpillEnd += f->image.used;
+    }
+    chainBytes -= f->image.used;
+    free(f->image.array);
+    spaceInit(&f->image);
+    chainResident[lru] = chainResident[--chainNumResident];
+  }
+}
+
+// Next frame of the previous stage; 0 when it has ended
+static int ioChainReceive() {
+  uint32_t size[2];
+  if (!readAll(chainInFd, size, sizeof(size))) return 0;
+  if ((chainNumFrames & (chainNumFrames + 1)) == 0) { // 0, 1, 3, 7...: grow to 1, 2, 4, 8...
+    chainFrames = realloc(chainFrames, 2 * (chainNumFrames + 1) * sizeof(ChainFrame));
+    if (!chainFrames) exit(OUT_OF_MEMORY);
+  }
+  ChainFrame* f = &chainFrames[chainNumFrames];
+  spaceInit(&f->image);
+  spaceReset(&f->image, (size_t)size[0] * size[1]);
+  if (!readAll(chainInFd, f->image.array, f->image.used)) {
+    free(f->image.array);
+    return 0;
+  }
+  f->width = size[0];
+  f->height = size[1];
+  f->spilled = -1;
+  f->lastUse = ++chainClock;
+  ioChainResident(chainNumFrames++);
+  ioChainEvict();
+  return 1;
+}
+
+static void ioChainReadFrame(uint64_t i, uint64_t* width, uint64_t* height) {
+  while (i >= chainNumFrames && !chainInEnded) {
+    chainInEnded = !ioChainReceive();
+  }
+  if (i >= chainNumFrames) {
+    *width = 0;
+    *height = 0;
+    return;
+  }
+  ChainFrame* f = &chainFrames[i];
+  if (!f->image.array && f->width && f->height) { // Back from the temporary file
+    spaceReset(&f->image, (size_t)f->width * f->height);
+    if (!spillAll(0, f->image.array, f->image.used, f->spilled)) {
+      perror("Temporary file of the chain");
+      exit(NOT_READABLE);
+    }
+    ioChainResident(i);
+  }
+  f->lastUse = ++chainClock;
+  chainCurrent = i;
+  ioChainEvict();
+  currentInPixels = f->image.array;
+  currentInSize = f->image.used;
+  currentInRowbytes = f->width;
+  *width = f->width;
+  *height = f->height;
+}
+
+// Hand an RGB image to the next stage (called in frame order)
+static void ioChainWrite(uint8_t* image, uint16_t width, uint16_t height) {
+  static __thread Space gray;
+  uint32_t size[2] = {width, height};
+  spaceReset(&gray, (size_t)width * height);
+  rgbToGray(gray.array, image, gray.used, 3);
+  if (!writeAll(chainOutFd, size, sizeof(size)) || !writeAll(chainOutFd, gray.array, gray.used)) {
+    exit(NOT_WRITEABLE); // The next stage is broken (if it has ended, SIGPIPE came first)
+  }
+}
+
+static void ioInitIn() {
+  struct stat si, so;
+  ioInitSimd();
+  inpIsOutDir = inpDir && outDir && (!strcmp(inpDir, outDir)
+    || (stat(inpDir, &si) == 0 && stat(outDir, &so) == 0
+        && si.st_dev == so.st_dev && si.st_ino == so.st_ino));
+  ioScanInput();
+  spaceInit(&currentInImage);
+  if (inpDir && opt_prefetch > 0) {
+    inPrefetchOn = !pthread_create(&inThread, NULL, ioPrefetcher, NULL);
+  }
+}
+
+static void ioReadFrame(uint64_t i, uint64_t* width, uint64_t* height) {
+  /*uma: if inpDir is the same as outDir, update numImpFiles because
+         new frames could have been generated*/
+  if (chainInFd >= 0) {
+    ioChainReadFrame(i, width, height);
+    return;
+  }
+  ioScanInput();
+  if (i >= (uint64_t)numInpFiles) {
+    *width = 0;
+    *height = 0;
+    return;
+  }
+  static char filename[MAX_FILENAME];
+  struct dirent* f = inpFiles[i];
+  sprintf(filename, "%s/%s", inpDir, f->d_name);
+
+  int type = ioFrameType(f->d_name);
+  if (type != IN_PNG) {
+    if (!ioMapFrame(filename, type, width, height)) {
+      perror(filename);
+      exit(NOT_READABLE);
+    }
+    return;
+  }
+  ioUnmapFrame();
+
+  if (inPrefetchOn || opt_in_cache) {
+    InFrame* p;
+    pthread_mutex_lock(&inLock);
+    while ((p = ioFindFrame(filename)) && (p->state == IN_QUEUED || p->state == IN_DECODING)) {
+      pthread_cond_wait(&inDone, &inLock);
+    }
+    struct stat st;
+    int hit = p && p->state == IN_READY && stat(filename, &st) == 0
+           && st.st_mtim.tv_sec == p->mtime.tv_sec && st.st_mtim.tv_nsec == p->mtime.tv_nsec;
+    if (p && !hit) {
+      ioDropFrame(p); // Failed or stale: read it again
+    }
+    if (hit && !opt_in_cache) {
+      Space t = currentInImage; currentInImage = p->image; p->image = t;
+      // Taken before the slot is freed: ioPrefetch() may reuse it at once
+      currentInPixels = currentInImage.array;
+      currentInSize = currentInImage.used;
+      currentInRowbytes = p->rowbytes;
+      *width = p->width;
+      *height = p->height;
+      p->state = IN_FREE;
+    }
+    if (inPrefetchOn) ioPrefetch(i);
+    if (!hit && opt_in_cache) {
+      p = ioNewFrameEntry(filename, IN_DECODING);
+    }
+    pthread_mutex_unlock(&inLock);
+
+    if (opt_in_cache) {
+      if (!hit && !ioDecodePng(filename, &p->image, &p->rowbytes, &p->width, &p->height, &p->mtime)) {
+        perror("png");
+        exit(NOT_READABLE);
+      }
+      pthread_mutex_lock(&inLock);
+      if (!hit) {
+        p->state = IN_READY;
+        inCacheBytes += p->image.used;
+      }
+      p->lastUse = ++inClock;
+      inCurrent = p;
+      ioEvictFrames();
+      pthread_mutex_unlock(&inLock);
+      currentInPixels = p->image.array;
+      currentInSize = p->image.used;
+      currentInRowbytes = p->rowbytes;
+      *width = p->width;
+      *height = p->height;
+      return;
+    }
+    if (hit) {
+      return;
+    }
+  }
+
+  struct timespec mtime;
+  if (!ioDecodePng(filename, &currentInImage, &currentInRowbytes, width, height, &mtime)) {
+    perror("png");
+    exit(NOT_READABLE);
+  }
+  currentInPixels = currentInImage.array;
+  currentInSize = currentInImage.used;
+}
+
+static uint8_t ioReadPixel(uint16_t x, uint16_t y) {
+  return currentInPixels[currentInRowbytes * y + x];
+}
+
+// Extension opcode READ_ROWS: copy rows of the last frame read (one gray
+// byte per pixel) to guest memory. Descriptor: destination address,
+// destination stride, first row and number of rows (clipped to the frame)
+static void ioReadRows(uint64_t* d) {
+  uint8_t* dst = (uint8_t*) d[0];
+  uint64_t stride = d[1], first = d[2], n = d[3];
+  uint64_t height = currentInRowbytes ? currentInSize / currentInRowbytes : 0;
+  if (first >= height) return;
+  if (n > height - first) n = height - first;
+  uint8_t* p = currentInPixels + first * currentInRowbytes;
+  if (stride == currentInRowbytes) {
+    memcpy(dst, p, n * currentInRowbytes); // Whole rows: one copy
+    return;
+  }
+  for (uint64_t k = 0; k < n; k++) {
+    memcpy(dst + k * stride, p + k * currentInRowbytes, currentInRowbytes);
+  }
+}
+
+
+/* Output state */
+
+// 16 MiB
+#define INITIAL_TEXT_SIZE    0x1000000
+#define INITIAL_BYTES_SIZE   0x1000000
+#define INITIAL_SAMPLES_SIZE 0x1000000
+#define INITIAL_OUT_IMG_SIZE 0x1000000
+
+static int outputCounter = 0;
+static Bytes currentText;
+static Bytes currentBytes;
+static Bytes currentSamples;
+static uint32_t currentSampleRate;
+static Space currentOutImage;
+static uint16_t currentOutWidth;
+static uint16_t currentOutHeight;
+
+
+/*
+  Output streams (--video-out, --audio-out): the frames are appended
+  to one file or pipe instead of a .png/.wav file per frame.
+  The video stream is y4m, raw rgb24 or concatenated ppm images; y4m
+  and rgb have the size of the first frame (other frames are cropped
+  or padded with black) and y4m the frame rate given by the samples
+  per frame of the first frame (or 25 fps without audio).
+  The audio stream is raw PCM, 16-bit stereo
+*/
+
+static FILE* videoStream = NULL;
+static FILE* audioStream = NULL;
+static FILE* apngStream = NULL;   // --apng, see ioApngWrite()
+static int videoWidth = -1;     // Size of the video stream (-1 until the first frame)
+static int videoHeight = 0;
+static uint32_t videoFpsNum = 25, videoFpsDen = 1;
+static int videoHeaderDone = 0;
+
+static FILE* ioOpenStream(char* name) {
+  FILE* f;
+  if (!strcmp(name, "-")) {
+    // The stream takes stdout; messages go to stderr from now on
+    // (including those still in the buffer of stdout)
+    int fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    f = fdopen(fd, "wb");
+  } else {
+    f = fopen(name, "wb");
+  }
+  if (!f) {
+    fprintf(stderr, "Trouble writing: %s\n", name);
+    exit(NOT_WRITEABLE);
+  }
+  return f;
+}
+
+/*
+  Byte stream (--bytes-out <fd|file|->): the bytes of PUT_BYTE go to an
+  open file descriptor, a file or stdout through a 1 MiB buffer, instead
+  of the .bytes file of each frame, so that a program can be a filter in
+  a pipeline. The buffer is written when it is full, at each new frame,
+  when READ_CHAR needs more input (see ioStdinRead()) and at exit.
+  When the target is a pipe, the buffer is handed to it with vmsplice()
+  instead of being copied. The pipe then refers to its pages, which the
+  reader may even pass on with splice(), so they are never written again:
+  once the buffer is full it is unmapped and a new one is mapped
+*/
+
+#define BYTES_OUT_SIZE 0x100000
+
+static FILE* bytesOutStream = NULL;
+static int bytesOutFd = -1;
+static int bytesOutPipe = 0;      // Target is a pipe: vmsplice()
+static int bytesOutSpliced = 0;   // Some of the buffer is referenced by the pipe
+static uint8_t* bytesOutBuf;
+static size_t bytesOutUsed = 0;   // Bytes in the buffer
+static size_t bytesOutSent = 0;   // Bytes of the buffer already written
+static int bytesOutAtExit = 0;    // Flushing from the atexit() handler
+
+static void ioBytesOutMap() {
+  bytesOutBuf = mmap(NULL, BYTES_OUT_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (bytesOutBuf == MAP_FAILED) {
+    exit(OUT_OF_MEMORY);
+  }
+  bytesOutUsed = bytesOutSent = 0;
+  bytesOutSpliced = 0;
+}
+
+static void ioBytesOutFlush() {
+  while (bytesOutSent < bytesOutUsed) {
+    ssize_t n;
+    if (bytesOutPipe) {
+      struct iovec v = {bytesOutBuf + bytesOutSent, bytesOutUsed - bytesOutSent};
+      n = vmsplice(bytesOutFd, &v, 1, 0);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        bytesOutPipe = 0; // Not supported here: copy
+        continue;
+      }
+      if (n > 0) bytesOutSpliced = 1;
+    } else {
+      n = write(bytesOutFd, bytesOutBuf + bytesOutSent, bytesOutUsed - bytesOutSent);
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) { // Non-blocking descriptor
+      struct pollfd pfd = {bytesOutFd, POLLOUT, 0};
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Trouble writing: %s\n", opt_bytes_out);
+      bytesOutUsed = bytesOutSent = 0; // Nothing left for the flush at exit
+      if (bytesOutAtExit) _exit(NOT_WRITEABLE); // exit() must not be called again
+      exit(NOT_WRITEABLE);
+    }
+    bytesOutSent += n;
+  }
+  if (bytesOutUsed == BYTES_OUT_SIZE) {
+    if (bytesOutSpliced) {
+      munmap(bytesOutBuf, BYTES_OUT_SIZE);
+      ioBytesOutMap();
+    } else {
+      bytesOutUsed = bytesOutSent = 0;
+    }
+  }
+}
+
+static void ioBytesOutFlushAtExit() {
+  bytesOutAtExit = 1;
+  ioBytesOutFlush();
+}
+
+// Input of READ_CHAR with a byte stream: the stream is flushed each time
+// more input has to be read, as a filter must give its output before
+// waiting for input (but not at each character, as stdin is buffered)
+static ssize_t ioStdinRead(void* cookie, char* buf, size_t size) {
+  (void)cookie;
+  ioBytesOutFlush();
+  ssize_t n;
+  do {
+    n = read(STDIN_FILENO, buf, size);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+static void ioInitBytesOut() {
+  char* end;
+  long fd = strtol(opt_bytes_out, &end, 10);
+  if (*opt_bytes_out && !*end) {
+    if (fd < 0 || fcntl(fd, F_GETFL) < 0) {
+      fprintf(stderr, "Trouble writing: file descriptor %s\n", opt_bytes_out);
+      exit(NOT_WRITEABLE);
+    }
+    bytesOutFd = fd;
+  } else {
+    bytesOutStream = ioOpenStream(opt_bytes_out); // Only its descriptor is used
+    bytesOutFd = fileno(bytesOutStream);
+  }
+  struct stat st;
+  if (fstat(bytesOutFd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    bytesOutPipe = 1;
+    fcntl(bytesOutFd, F_SETPIPE_SZ, BYTES_OUT_SIZE); // As large as the buffer, if allowed
+  }
+  ioBytesOutMap();
+  atexit(ioBytesOutFlushAtExit);
+  FILE* in = fopencookie(NULL, "r", (cookie_io_functions_t){ioStdinRead, NULL, NULL, NULL});
+  if (in) {
+    stdin = in;
+    stdinCookie = 1;
+  }
+}
+
+static void ioCloseBytesOut() {
+  if (bytesOutFd < 0) return;
+  ioBytesOutFlush();
+  if (bytesOutStream) fclose(bytesOutStream);
+  bytesOutStream = NULL;
+  bytesOutFd = -1;
+}
+
+static void ioInitStreams() {
+  int toStdout = (opt_video_out && !strcmp(opt_video_out, "-"))
+               + (opt_audio_out && !strcmp(opt_audio_out, "-"))
+               + (opt_bytes_out && !strcmp(opt_bytes_out, "-"));
+  if (toStdout > 1) {
+    fprintf(stderr, "Only one of the video, audio and byte streams can go to stdout\n");
+    exit(OPTION_PARSE_ERROR);
+  }
+  if (opt_video_out) videoStream = ioOpenStream(opt_video_out);
+  if (opt_audio_out) audioStream = ioOpenStream(opt_audio_out);
+  if (opt_bytes_out) ioInitBytesOut();
+  if (opt_apng) {
+    if (!strcmp(opt_apng, "-")) {
+      fprintf(stderr, "The APNG output must be a file\n");
+      exit(OPTION_PARSE_ERROR);
+    }
+    apngStream = ioOpenStream(opt_apng);
+  }
+}
+
+/*
+  Continuous WAV file (--wav-out <file>): the samples of all the frames
+  are appended to one WAV file, whose header is patched when it is
+  closed (at exit). A change of the sample rate (or reaching the 4 GiB
+  limit of the format) closes it and starts a new segment: file.1.wav,
+  file.2.wav, ...
+*/
+
+static FILE* wavStream = NULL;
+static int wavSegment = 0;
+static uint32_t wavRate;
+static uint64_t wavBytes;
+
+static void ioWavClose() {
+  if (!wavStream) return;
+  WavHeader h = wavBasicHeader;
+  h.chunkSize1 += wavBytes;
+  h.sampleRate = wavRate;
+  h.byteRate = 4U * wavRate;
+  h.chunkSize3 = wavBytes;
+  // Not seekable (e.g. a FIFO): the header keeps its "unknown" sizes
+  if (fseek(wavStream, 0, SEEK_SET) == 0) {
+    fwrite((const void*) &h, sizeof(WavHeader), 1, wavStream);
+  }
+  fclose(wavStream);
+  wavStream = NULL;
+}
+
+static void ioWavOpen(uint32_t sampleRate) {
+  size_t len = strlen(opt_wav_out);
+  char* filename = malloc(len + 16);
+  if (!filename) exit(OUT_OF_MEMORY);
+  strcpy(filename, opt_wav_out);
+  if (wavSegment > 0) {
+    if (len >= 4 && !strcmp(filename + len - 4, ".wav")) len -= 4;
+    sprintf(filename + len, ".%d.wav", wavSegment);
+  }
+  wavStream = fopen(filename, "wb");
+  if (!wavStream) {
+    fprintf(stderr, "Trouble writing: %s\n", filename);
+    exit(NOT_WRITEABLE);
+  }
+  free(filename);
+  WavHeader h = wavBasicHeader;
+  h.chunkSize1 = 0xffffffffU; // Sizes not known yet
+  h.sampleRate = sampleRate;
+  h.byteRate = 4U * sampleRate;
+  h.chunkSize3 = -1;
+  fwrite((const void*) &h, sizeof(WavHeader), 1, wavStream);
+  wavRate = sampleRate;
+  wavBytes = 0;
+}
+
+static void ioWavWrite(void* samples, size_t size, uint32_t sampleRate) {
+  if (size == 0) return;
+  if (wavStream && (sampleRate != wavRate || wavBytes + size > 0xffffffffUL - 36)) {
+    ioWavClose();
+    wavSegment++;
+  }
+  if (!wavStream) ioWavOpen(sampleRate);
+  if (fwrite(samples, 1, size, wavStream) < size) {
+    fprintf(stderr, "Trouble writing: %s\n", opt_wav_out);
+    exit(NOT_WRITEABLE);
+  }
+  wavBytes += size;
+}
+
+static void ioApngClose();
+
+static void ioCloseStreams() {
+  if (videoStream) fclose(videoStream);
+  if (audioStream) fclose(audioStream);
+  videoStream = audioStream = NULL;
+  ioWavClose();
+  ioApngClose();
+  ioCloseBytesOut();
+}
+
+static uint32_t gcd32(uint32_t a, uint32_t b) {
+  while (b) { uint32_t t = a % b; a = b; b = t; }
+  return a;
+}
+
+// Size and rate of the video stream, from the first frame with an image
+// (called in frame order)
+static void ioStreamSetup(uint16_t width, uint16_t height, uint32_t sampleRate, size_t sampleBytes) {
+  if (!videoStream || videoWidth >= 0 || width == 0 || height == 0) return;
+  videoWidth = width;
+  videoHeight = height;
+  uint32_t nsamples = sampleBytes / 4;
+  if (sampleRate > 0 && nsamples > 0) {
+    uint32_t g = gcd32(sampleRate, nsamples);
+    videoFpsNum = sampleRate / g;
+    videoFpsDen = nsamples / g;
+  }
+}
+
+/*
+  Convert an image into the video stream format in 'buf' and return
+  its size (the ppm header is included, the y4m one is not)
+*/
+static size_t ioVideoFrame(Space* buf, uint8_t* image, uint16_t width, uint16_t height) {
+  if (opt_video_format == VIDEO_PPM) {
+    char head[32];
+    int n = sprintf(head, "P6\n%u %u\n255\n", width, height);
+    size_t size = 3 * (size_t)width * height;
+    spaceReset(buf, n + size);
+    memcpy(buf->array, head, n);
+    memcpy((uint8_t*)buf->array + n, image, size);
+    return n + size;
+  }
+
+  size_t npix = (size_t)videoWidth * videoHeight;
+  spaceReset(buf, 3 * npix);
+  uint8_t* out = buf->array;
+  int w = width < videoWidth ? width : videoWidth;
+  int h = height < videoHeight ? height : videoHeight;
+
+  if (opt_video_format == VIDEO_RGB) {
+    memset(out, 0, 3 * npix);
+    for (int y = 0; y < h; y++) {
+      memcpy(out + 3 * (size_t)y * videoWidth, image + 3 * (size_t)y * width, 3 * w);
+    }
+    return 3 * npix;
+  }
+
+  // y4m, planar 4:4:4, full range BT.601 (as JPEG)
+  uint8_t* Y = out;
+  uint8_t* U = out + npix;
+  uint8_t* V = out + 2 * npix;
+  memset(Y, 0, npix);
+  memset(U, 128, 2 * npix);
+  for (int y = 0; y < h; y++) {
+    uint8_t* p = image + 3 * (size_t)y * width;
+    size_t k = (size_t)y * videoWidth;
+    for (int x = 0; x < w; x++, p += 3, k++) {
+      int r = p[0], g = p[1], b = p[2];
+      int cb = (-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32768) >> 16;
+      int cr = (32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32768) >> 16;
+      Y[k] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+      U[k] = cb > 255 ? 255 : cb;
+      V[k] = cr > 255 ? 255 : cr;
+    }
+  }
+  return 3 * npix;
+}
+
+// Append a converted frame and its samples to the streams
+static void ioStreamWrite(void* video, size_t videoSize, void* samples, size_t sampleBytes, uint32_t sampleRate) {
+  if (videoStream && videoSize > 0) {
+    if (opt_video_format == VIDEO_Y4M) {
+      if (!videoHeaderDone) {
+        fprintf(videoStream, "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C444 XCOLORRANGE=FULL\n",
+                videoWidth, videoHeight, videoFpsNum, videoFpsDen);
+        videoHeaderDone = 1;
+      }
+      fputs("FRAME\n", videoStream);
+    }
+    if (fwrite(video, 1, videoSize, videoStream) < videoSize) {
+      fprintf(stderr, "Trouble writing: %s\n", opt_video_out);
+      exit(NOT_WRITEABLE);
+    }
+  }
+  if (audioStream && sampleBytes > 0) {
+    if (fwrite(samples, 1, sampleBytes, audioStream) < sampleBytes) {
+      fprintf(stderr, "Trouble writing: %s\n", opt_audio_out);
+      exit(NOT_WRITEABLE);
+    }
+  }
+  if (opt_wav_out) {
+    ioWavWrite(samples, sampleBytes, sampleRate);
+  }
+}
+
+/*
+  Animated PNG (--apng <file>): the frames are written as one APNG file
+  instead of a .png file per frame. The first frame is complete, and each
+  of the next ones only has the rectangle where it differs from the one
+  before (drawn over it), so a still or slowly changing scene costs little
+  to compress and to store. The animation has the size of the first frame
+  (others are cropped or padded with black) and each frame lasts as long
+  as its samples (1/25 s without audio). The number of frames is written
+  in the header when the file is closed
+*/
+
+static int apngWidth = -1;       // Size of the animation (-1 until the first frame)
+static int apngHeight = 0;
+static uint32_t apngFrames = 0;
+static uint32_t apngSeq = 0;     // Sequence number of the fcTL and fdAT chunks
+static Space apngPrev;           // Last frame written
+static Space apngCur;            // Frame padded/cropped to the size of the animation
+static Space apngRect;           // Changed rectangle
+static Space apngZ;              // Compressed rectangle
+
+static void put32(uint8_t* p, uint32_t x) {
+  p[0] = x >> 24; p[1] = x >> 16; p[2] = x >> 8; p[3] = x;
+}
+
+// Frame control: region of the frame, duration, no dispose and no blend
+static void apngWriteFctl(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint16_t num, uint16_t den) {
+  uint8_t fctl[26];
+  put32(fctl, apngSeq++);
+  put32(fctl + 4, w);
+  put32(fctl + 8, h);
+  put32(fctl + 12, x);
+  put32(fctl + 16, y);
+  fctl[20] = num >> 8; fctl[21] = num;
+  fctl[22] = den >> 8; fctl[23] = den;
+  fctl[24] = 0; // APNG_DISPOSE_OP_NONE
+  fctl[25] = 0; // APNG_BLEND_OP_SOURCE
+  pngWriteChunk(apngStream, "fcTL", fctl, sizeof(fctl));
+}
+
+// Frame data: IDAT chunks for the first frame, fdAT (IDAT with a sequence number) for the next ones
+static void apngWriteData(const uint8_t* data, size_t size) {
+  for (size_t k = 0; k < size; k += 0x40000000) { // Chunks up to 1 GiB
+    uint32_t len = size - k < 0x40000000 ? size - k : 0x40000000;
+    if (apngFrames == 0) {
+      pngWriteChunk(apngStream, "IDAT", data + k, len);
+      continue;
+    }
+    uint8_t head[12];
+    put32(head, len + 4);
+    memcpy(head + 4, "fdAT", 4);
+    put32(head + 8, apngSeq++);
+    uint32_t crc = crc32(crc32(0, head + 4, 8), data + k, len);
+    uint8_t tail[4];
+    put32(tail, crc);
+    if (fwrite(head, 1, 12, apngStream) < 12 || fwrite(data + k, 1, len, apngStream) < len
+    || fwrite(tail, 1, 4, apngStream) < 4) {
+      fprintf(stderr, "Trouble writing: %s\n", opt_apng);
+      exit(NOT_WRITEABLE);
+    }
+  }
+}
+
+// Append a frame to the animation (called in frame order)
+static void ioApngWrite(uint8_t* image, uint16_t width, uint16_t height, size_t sampleBytes, uint32_t sampleRate) {
+  if (!apngStream || width == 0 || height == 0) return;
+  if (apngWidth < 0) {
+    apngWidth = width;
+    apngHeight = height;
+    uint8_t ihdr[13] = {0, 0, width >> 8, width, 0, 0, height >> 8, height,
+                        8, 2, 0, 0, 0}; // 8-bit RGB, no interlace
+    uint8_t actl[8] = {0}; // Number of frames (written at the end), loop forever
+    if (fwrite(pngSignature, 1, 8, apngStream) < 8) exit(NOT_WRITEABLE);
+    pngWriteChunk(apngStream, "IHDR", ihdr, sizeof(ihdr));
+    pngWriteChunk(apngStream, "acTL", actl, sizeof(actl));
+    spaceReset(&apngPrev, 3 * (size_t)width * height);
+  }
+  size_t rowbytes = 3 * (size_t)apngWidth;
+  uint8_t* cur = image;
+  if (width != apngWidth || height != apngHeight) {
+    int w = width < apngWidth ? width : apngWidth;
+    int h = height < apngHeight ? height : apngHeight;
+    spaceReset(&apngCur, rowbytes * apngHeight);
+    cur = apngCur.array;
+    memset(cur, 0, rowbytes * apngHeight);
+    for (int y = 0; y < h; y++) {
+      memcpy(cur + y * rowbytes, image + 3 * (size_t)y * width, 3 * w);
+    }
+  }
+
+  // Rectangle [x0, x1) x [y0, y1) where the frame differs from the last one
+  uint32_t x0 = 0, y0 = 0, x1 = apngWidth, y1 = apngHeight;
+  uint8_t* prev = apngPrev.array;
+  if (apngFrames > 0) {
+    while (y0 < y1 && !memcmp(cur + y0 * rowbytes, prev + y0 * rowbytes, rowbytes)) y0++;
+    while (y1 > y0 && !memcmp(cur + (y1 - 1) * rowbytes, prev + (y1 - 1) * rowbytes, rowbytes)) y1--;
+    if (y0 == y1) {
+      x1 = y1 = 1; // Unchanged: a frame cannot be empty, so one pixel again
+      y0 = 0;
+    } else {
+      x0 = apngWidth;
+      x1 = 0;
+      for (uint32_t y = y0; y < y1; y++) {
+        uint8_t* a = cur + y * rowbytes;
+        uint8_t* b = prev + y * rowbytes;
+        uint32_t l = 0, r = apngWidth;
+        while (l < x0 && !memcmp(a + 3 * l, b + 3 * l, 3)) l++;
+        while (r > x1 && r > l && !memcmp(a + 3 * (r - 1), b + 3 * (r - 1), 3)) r--;
+        if (l < x0) x0 = l;
+        if (r > x1) x1 = r;
+      }
+    }
+  }
+  uint32_t w = x1 - x0, h = y1 - y0;
+  uint8_t* rect = cur + y0 * rowbytes;
+  if ((int)w < apngWidth) {
+    spaceReset(&apngRect, 3 * (size_t)w * h);
+    rect = apngRect.array;
+    for (uint32_t y = 0; y < h; y++) {
+      memcpy(rect + 3 * (size_t)y * w, cur + (y0 + y) * rowbytes + 3 * x0, 3 * w);
+    }
+  }
+  for (uint32_t y = y0; y < y1; y++) {
+    memcpy(prev + y * rowbytes + 3 * x0, cur + y * rowbytes + 3 * x0, 3 * w);
+  }
+
+  uint16_t num = 1, den = 25;
+  uint32_t nsamples = sampleBytes / 4;
+  if (sampleRate > 0 && nsamples > 0) {
+    uint32_t g = gcd32(sampleRate, nsamples);
+    if (nsamples / g <= 0xffff && sampleRate / g <= 0xffff) {
+      num = nsamples / g;
+      den = sampleRate / g;
+    } else {
+      uint64_t ms = nsamples * 1000ULL / sampleRate;
+      num = ms < 0xffff ? ms : 0xffff;
+      den = 1000;
+    }
+  }
+  int level = opt_png == PNG_STORE ? Z_NO_COMPRESSION
+            : opt_png == PNG_DEFAULT ? Z_DEFAULT_COMPRESSION : Z_BEST_SPEED;
+  size_t zsize = pngDeflate(&apngZ, rect, w, h, level);
+  apngWriteFctl(x0, y0, w, h, num, den);
+  apngWriteData(apngZ.array, zsize);
+  apngFrames++;
+}
+
+static void ioApngClose() {
+  if (!apngStream) return;
+  if (apngFrames > 0) {
+    uint8_t actl[8] = {0};
+    put32(actl, apngFrames);
+    pngWriteChunk(apngStream, "IEND", NULL, 0);
+    if (fseek(apngStream, 8 + 12 + 13, SEEK_SET) != 0) { // acTL, after the signature and IHDR
+      fprintf(stderr, "Trouble writing: %s\n", opt_apng);
+      exit(NOT_WRITEABLE);
+    }
+    pngWriteChunk(apngStream, "acTL", actl, sizeof(actl));
+  }
+  if (fclose(apngStream) != 0) {
+    fprintf(stderr, "Trouble writing: %s\n", opt_apng);
+    exit(NOT_WRITEABLE);
+  }
+  apngStream = NULL;
+}
+
+/*
+  Console sink: the characters of PUT_CHAR go to stderr through
+  a buffer instead of a write per character. It is flushed when
+  it is full, at each newline if stderr is a terminal, before
+  reading a character, at each new frame and at exit
+*/
+
+#define CONSOLE_BUF_SIZE 0x10000
+
+static char consoleBuf[CONSOLE_BUF_SIZE];
+static size_t consoleUsed = 0;
+static int consoleIsTty = 0;
+
+static void ioConsoleFlush() {
+  size_t done = 0;
+  while (done < consoleUsed) {
+    ssize_t n = write(STDERR_FILENO, consoleBuf + done, consoleUsed - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break; // Nowhere to write: the output is lost, as with stderr
+    done += n;
+  }
+  consoleUsed = 0;
+}
+
+static void ioConsoleWrite(const void* p, size_t n) {
+  if (consoleUsed + n > CONSOLE_BUF_SIZE) {
+    ioConsoleFlush();
+  }
+  memcpy(consoleBuf + consoleUsed, p, n);
+  consoleUsed += n;
+#if (VERBOSE >= 2)
+  ioConsoleFlush(); // In step with the trace
+#else
+  if (consoleIsTty && memchr(p, '\n', n)) {
+    ioConsoleFlush();
+  }
+#endif
+}
+
+static void ioInitOut() {
+  if (outDir) {
+    if (strlen(outDir) + 16 > MAX_FILENAME) {
+      exit(STRING_TOO_LONG);
+    }
+  }
+  bytesInit(&currentText, INITIAL_TEXT_SIZE);
+  bytesInit(&currentBytes, INITIAL_BYTES_SIZE);
+  bytesInit(&currentSamples, INITIAL_SAMPLES_SIZE);
+  spaceInit(&currentOutImage);
+  ioInitSimd();
+  ioInitStreams();
+  ioInitAsync();
+  consoleIsTty = isatty(STDERR_FILENO);
+  atexit(ioConsoleFlush);
+}
+
+static int outputCounter_cur = -1; // Frame whose console files were last written
+
+/*
+  The .text and .bytes files of the current frame stay open from flush
+  to flush (e.g. each time the text buffer fills), and are closed when
+  the frame changes or at exit. With an asynchronous output backend
+  they are handed to it as whole files instead
+*/
+#define CONSOLE_TEXT  0
+#define CONSOLE_BYTES 1
+static int consoleFd[2] = {-1, -1};
+static int consoleFdFrame = -1;    // Frame of the open console files
+
+static void ioCloseConsoleFiles() {
+  for (int k = 0; k < 2; k++) {
+    if (consoleFd[k] >= 0) close(consoleFd[k]);
+    consoleFd[k] = -1;
+  }
+}
+
+static void ioWriteConsoleFile(int k, char* filename, Bytes* b, int append) {
+  if (opt_out_backend != OUT_SYNC) {
+    writeFile(filename, b->array, b->used, append);
+    return;
+  }
+  if (consoleFdFrame != outputCounter) {
+    ioCloseConsoleFiles();
+    consoleFdFrame = outputCounter;
+  }
+  if (consoleFd[k] < 0) {
+    consoleFd[k] = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+  }
+  if (consoleFd[k] < 0 || !writeAll(consoleFd[k], b->array, b->used)) {
+    fprintf(stderr, "Trouble writing: %s\n", filename);
+    exit(NOT_WRITEABLE);
+  }
+}
+
+static void ioFlush_console() {  //*uma: flush current cumulative text without increasing frame number
+  if (outDir) {
+    static char filename[MAX_FILENAME];
+    char* ext = filename + sprintf(filename, "%s/%08d.", outDir, outputCounter);
+
+    int append = outputCounter_cur == outputCounter;
+
+    if (currentText.used > 0) {
+      sprintf(ext, "text");
+      ioWriteConsoleFile(CONSOLE_TEXT, filename, &currentText, append);
+    }
+    if (currentBytes.used > 0) {
+      sprintf(ext, "bytes");
+      ioWriteConsoleFile(CONSOLE_BYTES, filename, &currentBytes, append);
+    }
+  }
+  currentText.used = 0;
+  currentBytes.used = 0;
+  outputCounter_cur = outputCounter;
+}
+
+static void ioFlush() {
+  ioConsoleFlush();
+  ioBytesOutFlush();
+  if (outDir) {
+    static char filename[MAX_FILENAME];
+    char* ext = filename + sprintf(filename, "%s/%08d.", outDir, outputCounter);
+    //~ if (currentText.used > 0) {
+    //~   sprintf(ext, "text");
+    //~   //writeFile(filename, currentText.array, currentText.used);
+    //~   writeFile_append(filename, currentText.array, currentText.used); //*uma
+    //~ }
+    //~ if (currentBytes.used > 0) {
+    //~   sprintf(ext, "bytes");
+    //~   //writeFile(filename, currentBytes.array, currentBytes.used);
+    //~   writeFile_append(filename, currentBytes.array, currentBytes.used); //*uma
+    //~ }
+
+    ioFlush_console(); //*uma
+
+    if (currentSamples.used > 0 && !audioStream && !opt_wav_out) {
+      sprintf(ext, "wav");
+      writeWav(filename, currentSamples.array, currentSamples.used, currentSampleRate);
+    }
+    if (currentOutImage.used > 0 && !videoStream && !apngStream) {
+      sprintf(ext, "png");
+      writePng(filename, currentOutImage.array, currentOutWidth, currentOutHeight);
+    }
+  }
+  if (currentOutImage.used > 0 && chainOutFd >= 0) {
+    ioChainWrite(currentOutImage.array, currentOutWidth, currentOutHeight);
+  }
+  if (videoStream || audioStream || opt_wav_out || apngStream) {
+    static Space video;
+    size_t videoSize = 0;
+    ioStreamSetup(currentOutWidth, currentOutHeight, currentSampleRate, currentSamples.used);
+    if (videoStream && currentOutImage.used > 0) {
+      videoSize = ioVideoFrame(&video, currentOutImage.array, currentOutWidth, currentOutHeight);
+    }
+    if (currentOutImage.used > 0) {
+      ioApngWrite(currentOutImage.array, currentOutWidth, currentOutHeight, currentSamples.used, currentSampleRate);
+    }
+    ioStreamWrite(video.array, videoSize, currentSamples.array, currentSamples.used, currentSampleRate);
+  }
+  currentText.used = 0;
+  currentBytes.used = 0;
+  currentSamples.used = 0;
+  currentOutImage.used = 0;
+  outputCounter++;
+}
+
+
+static void ioPutChar(uint32_t c) {
+  int start = currentText.used;
+  bytesPutChar(&currentText, c);
+  int len = currentText.used - start;
+  //printf("%.*s", len, currentText.array + start); //original
+  ioConsoleWrite(currentText.array + start, len); //*uma: put_char to stderr as "ivm run" does
+  if (currentText.used + 5 > INITIAL_TEXT_SIZE){ //*uma: flush console if buffer exhausted
+    ioFlush_console();
+  }
+}
+
+static void ioPutByte(uint8_t x) {
+  if (bytesOutFd >= 0) {
+    bytesOutBuf[bytesOutUsed++] = x;
+    if (bytesOutUsed == BYTES_OUT_SIZE) ioBytesOutFlush();
+    return;
+  }
+  bytesPutByte(&currentBytes, x);
+  if (currentBytes.used >= INITIAL_BYTES_SIZE){ //*uma: flush console if buffer exhausted
+    ioFlush_console();
+  }
+}
+
+static void ioAddSample(uint16_t left, uint16_t right) {
+  bytesPutSample(&currentSamples, left, right);
+}
+
+static void ioNewFrame(uint16_t width, uint16_t height, uint32_t sampleRate) {
+  currentSampleRate = sampleRate;
+  currentOutWidth = width;
+  currentOutHeight = height;
+  spaceReset(&currentOutImage, 3 * width * height);
+}
+
+static void ioSetPixel(uint16_t x, uint16_t y, uint64_t r, uint64_t g, uint64_t b) {
+  uint8_t* p = currentOutImage.array + (y * currentOutWidth + x) * 3;
+  p[0] = (uint8_t) r;
+  p[1] = (uint8_t) g;
+  p[2] = (uint8_t) b;
+}
+
+// Extension opcode BLIT: copy a rectangle of packed RGB from guest memory
+// to the current frame. Descriptor: x, y, width, height, source address and
+// source stride (bytes from row to row); the part out of the frame is clipped
+static void ioBlit(uint64_t* d) {
+  uint64_t x = d[0], y = d[1], w = d[2], h = d[3], stride = d[5];
+  uint8_t* src = (uint8_t*) d[4];
+  if (x >= currentOutWidth || y >= currentOutHeight) return;
+  if (w > currentOutWidth - x) w = currentOutWidth - x;
+  if (h > currentOutHeight - y) h = currentOutHeight - y;
+  size_t rowbytes = 3 * (size_t)currentOutWidth;
+  uint8_t* p = currentOutImage.array + y * rowbytes + 3 * x;
+  if (w * 3 == rowbytes && stride == rowbytes) {
+    memcpy(p, src, h * rowbytes); // Whole rows: one copy
+    return;
+  }
+  for (uint64_t k = 0; k < h; k++) {
+    memcpy(p + k * rowbytes, src + k * stride, 3 * w);
+  }
+}
+
+/*
+  Output that goes nowhere. Without -o, the images and samples of the
+  frames are only used by the streams, and PUT_BYTE by --bytes-out; with
+  --discard-output nothing is kept, not even PUT_CHAR on the console.
+  The output instructions of what is discarded are then bound to code
+  that only pops their operands (see ivm_emu.c), so nothing is buffered
+  or encoded
+*/
+static int ioDiscarded() {
+  if (opt_discard_output) return DISCARD_FRAMES | DISCARD_BYTES | DISCARD_CHARS;
+  int d = 0;
+  if (!outDir && !videoStream && !audioStream && !opt_wav_out && !apngStream && chainOutFd < 0) {
+    d |= DISCARD_FRAMES;
+  }
+  if (!outDir && bytesOutFd < 0) d |= DISCARD_BYTES;
+  return d;
+}
+
+// NEW_FRAME when the frames are discarded
+static void ioSkipFrame() {
+  ioConsoleFlush();
+  ioBytesOutFlush();
+  outputCounter++;
+}
+
+
+#ifdef PARALLEL_OUTPUT
+/* Parallel output: a pool of threads writes the finished frames */
+
+typedef struct {
+  int counter;         // Frame number (name of the files)
+  int append;          // Console files already started by ioFlush_console()
+  Bytes text;
+  Bytes bytes;
+  Bytes samples;
+  uint32_t sampleRate;
+  Space image;
+  uint16_t width;
+  uint16_t height;
+  int pngPending;      // Its PNG file is being written (see ioWaitInput())
+} OutFrame;
+
+static OutFrame* outFrames;        // Frames owned by the pool (2 per worker)
+static OutFrame** outFree;         // Stack of recycled frames
+static int outNumFree;
+static OutFrame** outQueue;        // Ring of frames waiting to be written
+static int outQueueHead, outQueueLen;
+static int outNumFrames;
+static int outPending = 0;         // Frames queued or being written
+static int outQuit = 0;
+static int outNumWorkers = 0;
+static pthread_t* outWorkers;
+static pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outWork = PTHREAD_COND_INITIALIZER;  // Queue not empty
+static pthread_cond_t outDone = PTHREAD_COND_INITIALIZER;  // A frame written
+static int outStreamNext = -1;     // Next frame to be appended to the streams
+static pthread_cond_t outStreamTurn = PTHREAD_COND_INITIALIZER;
+
+static void ioWriteFrame(OutFrame* f) {
+  if (outDir) {
+    char filename[MAX_FILENAME]; // Not static: several workers write at once
+    char* ext = filename + sprintf(filename, "%s/%08d.", outDir, f->counter);
+    if (f->text.used > 0) {
+      sprintf(ext, "text");
+      writeFile(filename, f->text.array, f->text.used, f->append);
+    }
+    if (f->bytes.used > 0) {
+      sprintf(ext, "bytes");
+      writeFile(filename, f->bytes.array, f->bytes.used, f->append);
+    }
+    if (f->samples.used > 0 && !audioStream && !opt_wav_out) {
+      sprintf(ext, "wav");
+      writeWav(filename, f->samples.array, f->samples.used, f->sampleRate);
+    }
+    if (f->image.used > 0 && !videoStream && !apngStream) {
+      sprintf(ext, "png");
+      writePng(filename, f->image.array, f->width, f->height);
+    }
+  }
+  if (videoStream || audioStream || opt_wav_out || apngStream || chainOutFd >= 0) {
+    // Frames are converted in parallel, but appended in order
+    static __thread Space video;
+    size_t videoSize = 0;
+    if (videoStream && f->image.used > 0) {
+      videoSize = ioVideoFrame(&video, f->image.array, f->width, f->height);
+    }
+    pthread_mutex_lock(&outLock);
+    while (outStreamNext != f->counter) {
+      pthread_cond_wait(&outStreamTurn, &outLock);
+    }
+    pthread_mutex_unlock(&outLock);
+    if (f->image.used > 0) {
+      ioApngWrite(f->image.array, f->width, f->height, f->samples.used, f->sampleRate);
+      if (chainOutFd >= 0) ioChainWrite(f->image.array, f->width, f->height);
+    }
+    ioStreamWrite(video.array, videoSize, f->samples.array, f->samples.used, f->sampleRate);
+    pthread_mutex_lock(&outLock);
+    outStreamNext++;
+    pthread_cond_broadcast(&outStreamTurn);
+    pthread_mutex_unlock(&outLock);
+  }
+}
+
+static void* ioWorker(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&outLock);
+  while (1) {
+    while (outQueueLen == 0 && !outQuit) {
+      pthread_cond_wait(&outWork, &outLock);
+    }
+    if (outQueueLen == 0) break;
+    OutFrame* f = outQueue[outQueueHead];
+    outQueueHead = (outQueueHead + 1) % outNumFrames;
+    outQueueLen--;
+    pthread_mutex_unlock(&outLock);
+
+    ioWriteFrame(f);
+    f->text.used = f->bytes.used = f->samples.used = f->image.used = 0;
+
+    pthread_mutex_lock(&outLock);
+    f->pngPending = 0;
+    outFree[outNumFree++] = f;
+    outPending--;
+    pthread_cond_broadcast(&outDone);
+  }
+  pthread_mutex_unlock(&outLock);
+  return NULL;
+}
+
+#define OUT_NAME_SIZE 16               // "%08d.png" of any frame number
+static char (*outNames)[OUT_NAME_SIZE];   // One per pool frame (see ioWaitInput())
+
+static void ioInitWorkers(int n) {
+  outNumWorkers = n < 1 ? 1 : n;
+  outNumFrames = 2 * outNumWorkers;
+  outFrames = calloc(outNumFrames, sizeof(OutFrame));
+  outFree = malloc(outNumFrames * sizeof(OutFrame*));
+  outQueue = malloc(outNumFrames * sizeof(OutFrame*));
+  outWorkers = malloc(outNumWorkers * sizeof(pthread_t));
+  outNames = malloc(outNumFrames * sizeof(*outNames));
+  if (!outFrames || !outFree || !outQueue || !outWorkers || !outNames) exit(OUT_OF_MEMORY);
+  for (int i = 0; i < outNumFrames; i++) {
+    // Same sizes as the current buffers, which they replace
+    // (untouched pages of these allocations are never committed)
+    bytesInit(&outFrames[i].text, INITIAL_TEXT_SIZE);
+    bytesInit(&outFrames[i].bytes, INITIAL_BYTES_SIZE);
+    bytesInit(&outFrames[i].samples, INITIAL_SAMPLES_SIZE);
+    spaceInit(&outFrames[i].image);
+    outFree[i] = &outFrames[i];
+  }
+  outNumFree = outNumFrames;
+  outQueueHead = outQueueLen = 0;
+  for (int i = 0; i < outNumWorkers; i++) {
+    if (pthread_create(&outWorkers[i], NULL, ioWorker, NULL)) {
+      fprintf(stderr, "** Error creating output threads\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Wait until all the frames handed to the workers are written
+static void ioWaitWorkers() {
+  pthread_mutex_lock(&outLock);
+  while (outPending > 0) {
+    pthread_cond_wait(&outDone, &outLock);
+  }
+  pthread_mutex_unlock(&outLock);
+}
+
+static int cmpNames(const void* a, const void* b) {
+  return strcoll((const char*) a, (const char*) b);
+}
+
+/*
+  Before READ_FRAME i: wait only for the frames being written that the
+  input frame can depend on. None, unless the input directory is the
+  output one. If it is, the PNG file of a frame in flight matters when
+  its name sorts before or as the i-th file of the directory with all
+  those files written: it is that file or it shifts the files after it
+*/
+static void ioWaitInput(uint64_t i) {
+  if (!inpDir || !inpIsOutDir) return;
+  char (*names)[OUT_NAME_SIZE] = outNames;
+  while (1) {
+    ioScanInput();
+    pthread_mutex_lock(&outLock);
+    int n = 0;
+    for (int k = 0; k < outNumFrames; k++) {
+      if (outFrames[k].pngPending) snprintf(names[n++], OUT_NAME_SIZE, "%08d.png", outFrames[k].counter);
+    }
+    if (n == 0) break;
+    qsort(names, n, OUT_NAME_SIZE, cmpNames);
+
+    // i-th name of both sorted lists merged (files being written may be listed already)
+    const char* target = NULL;
+    uint64_t pos = 0;
+    for (int a = 0, b = 0; (a < numInpFiles || b < n) && !target; pos++) {
+      int c = a >= numInpFiles ? 1 : b >= n ? -1 : strcoll(inpFiles[a]->d_name, names[b]);
+      const char* x = c < 0 ? inpFiles[a]->d_name : names[b];
+      if (c <= 0) a++;
+      if (c >= 0) b++;
+      if (pos == i) target = x;
+    }
+    if (!target || strcoll(names[0], target) > 0) break; // Beyond all the files, or before all in flight
+    pthread_cond_wait(&outDone, &outLock);
+    pthread_mutex_unlock(&outLock);
+  }
+  pthread_mutex_unlock(&outLock);
+}
+
+static void ioStopWorkers() {
+  pthread_mutex_lock(&outLock);
+  outQuit = 1;
+  pthread_cond_broadcast(&outWork);
+  pthread_mutex_unlock(&outLock);
+  for (int i = 0; i < outNumWorkers; i++) {
+    pthread_join(outWorkers[i], NULL);
+  }
+  outNumWorkers = 0;
+}
+
+static void bytesSwap(Bytes* a, Bytes* b) {
+  Bytes t = *a; *a = *b; *b = t;
+}
+
+/*
+  Hand the current frame to the workers (parallel version of ioFlush):
+  its buffers are swapped with those of a recycled frame, so nothing
+  is copied but the image, whose pixels are kept for the next frame
+  as in the sequential version
+*/
+static void ioFlushParallel() {
+  ioConsoleFlush();
+  ioBytesOutFlush();
+  if (!outDir && !videoStream && !audioStream && !opt_wav_out && !apngStream && chainOutFd < 0) {
+    currentText.used = 0;
+    currentBytes.used = 0;
+    currentSamples.used = 0;
+    currentOutImage.used = 0;
+    outputCounter++;
+    return;
+  }
+
+  pthread_mutex_lock(&outLock);
+  while (outNumFree == 0) {
+    pthread_cond_wait(&outDone, &outLock);
+  }
+  OutFrame* f = outFree[--outNumFree];
+  if (outStreamNext < 0) outStreamNext = outputCounter;
+  pthread_mutex_unlock(&outLock);
+  ioStreamSetup(currentOutWidth, currentOutHeight, currentSampleRate, currentSamples.used);
+
+  f->counter = outputCounter;
+  f->append = outputCounter_cur == outputCounter;
+  f->sampleRate = currentSampleRate;
+  f->width = currentOutWidth;
+  f->height = currentOutHeight;
+  bytesSwap(&f->text, &currentText);
+  bytesSwap(&f->bytes, &currentBytes);
+  bytesSwap(&f->samples, &currentSamples);
+  Space t = f->image; f->image = currentOutImage; currentOutImage = t;
+  if (f->image.used > 0) {
+    spaceReset(&currentOutImage, f->image.used);
+    memcpy(currentOutImage.array, f->image.array, f->image.used);
+  }
+  currentOutImage.used = 0;
+
+  pthread_mutex_lock(&outLock);
+  f->pngPending = outDir && f->image.used > 0 && !videoStream && !apngStream;
+  outQueue[(outQueueHead + outQueueLen) % outNumFrames] = f;
+  outQueueLen++;
+  outPending++;
+  pthread_cond_signal(&outWork);
+  pthread_mutex_unlock(&outLock);
+
+  outputCounter_cur = outputCounter;
+  outputCounter++;
+}
+#endif
+
+
+/* Snapshot of the I/O state */
+
+static void ioSaveArray(FILE* f, void* start, size_t size) {
+  uint64_t n = size;
+  if (fwrite(&n, sizeof(n), 1, f) < 1 || fwrite(start, 1, size, f) < size) {
+    exit(NOT_WRITEABLE);
+  }
+}
+
+static size_t ioLoadSize(FILE* f) {
+  uint64_t n;
+  if (fread(&n, sizeof(n), 1, f) < 1) exit(NOT_READABLE);
+  return n;
+}
+
+static void ioLoadBytes(FILE* f, Bytes* b) {
+  size_t n = ioLoadSize(f);
+  b->used = 0;
+  bytesMakeSpace(b, n);
+  if (fread(b->array, 1, n, f) < n) exit(NOT_READABLE);
+  b->used = n;
+}
+
+static void ioLoadSpace(FILE* f, Space* s) {
+  size_t n = ioLoadSize(f);
+  if (n > 0) {
+    spaceReset(s, n);
+    if (fread(s->array, 1, n, f) < n) exit(NOT_READABLE);
+  }
+  s->used = n;
+}
+
+// Pending output of the current frame and the last input frame read
+static void ioSaveState(FILE* f) {
+#ifdef PARALLEL_OUTPUT
+  ioWaitWorkers(); // The frames already handed over are written before the snapshot
+#endif
+  ioWaitAsync();
+  int32_t counters[2] = {outputCounter, outputCounter_cur};
+  uint64_t frame[4] = {currentSampleRate, currentOutWidth, currentOutHeight, currentInRowbytes};
+  if (fwrite(counters, sizeof(counters), 1, f) < 1 || fwrite(frame, sizeof(frame), 1, f) < 1) {
+    exit(NOT_WRITEABLE);
+  }
+  ioSaveArray(f, currentText.array, currentText.used);
+  ioSaveArray(f, currentBytes.array, currentBytes.used);
+  ioSaveArray(f, currentSamples.array, currentSamples.used);
+  ioSaveArray(f, currentOutImage.array, currentOutImage.used);
+  ioSaveArray(f, currentInPixels, currentInRowbytes ? currentInSize : 0);
+}
+
+static void ioLoadState(FILE* f) {
+  int32_t counters[2];
+  uint64_t frame[4];
+  if (fread(counters, sizeof(counters), 1, f) < 1 || fread(frame, sizeof(frame), 1, f) < 1) {
+    exit(NOT_READABLE);
+  }
+  outputCounter = counters[0];
+  outputCounter_cur = counters[1];
+  currentSampleRate = frame[0];
+  currentOutWidth = frame[1];
+  currentOutHeight = frame[2];
+  ioLoadBytes(f, &currentText);
+  ioLoadBytes(f, &currentBytes);
+  ioLoadBytes(f, &currentSamples);
+  ioLoadSpace(f, &currentOutImage);
+  ioLoadSpace(f, &currentInImage);
+  currentInPixels = currentInImage.array;
+  currentInSize = currentInImage.used;
+  currentInRowbytes = currentInImage.used ? frame[3] : 0;
+  inCurrent = NULL;
 }
@@ -0,0 +1,364 @@
+/*
+ Preservation Virtual Machine Project
+
+ Yet another ivm emulator
+
+ Output backends of the sequential build (--out-backend sync|thread|uring)
+
+ The output files (.text, .bytes, .wav, .png) are written by the usual
+ functions of ivm_io.h, opened with ioOutOpen() instead of fopen().
+ With an asynchronous backend the file is written into a memory buffer,
+ and fclose() hands the whole file to the backend:
+   - sync:   no buffer, fopen/fwrite/fclose on the emulator thread (default)
+   - thread: the files are written in order by a writer thread
+   - uring:  open, write and close of each file are submitted as one
+             linked chain of io_uring requests; completions are reaped
+             when the next file is submitted. If io_uring is not
+             available, it falls back to 'thread'
+ Buffers are recycled once their file is written. A failed write ends
+ the run when its completion is seen (exit code NOT_WRITEABLE).
+
+ The parallel build already writes its frames on worker threads,
+ so there ioOutOpen() is just fopen()
+
+ Include it from ivm_io.h, after the exit codes
+*/
+
+#ifndef __IVM_IO_ASYNC_H
+#define __IVM_IO_ASYNC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+// Write all the buffer to a file descriptor; return 0 on error
+static int writeAll(int fd, const void* start, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write(fd, (const uint8_t*)start + done, size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    done += n;
+  }
+  return 1;
+}
+
+#ifndef PARALLEL_OUTPUT
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define AIO_MAX_JOBS   32          // Files buffered or being written
+#define AIO_CHUNK      0x40000000  // Largest single write (1 GiB)
+#define AIO_MAX_CHAIN  16          // Writes per file in one chain (bigger files are written at once)
+#define AIO_SQ_ENTRIES 256
+#define AIO_CQ_ENTRIES 1024
+
+typedef struct {
+  char filename[MAX_FILENAME];
+  int append;
+  uint8_t* data;                   // Contents of the file (kept from file to file)
+  size_t size;
+  size_t used;
+} AioJob;
+
+static AioJob aioJobs[AIO_MAX_JOBS];
+static int aioFree[AIO_MAX_JOBS];  // Stack of free jobs
+static int aioNumFree = 0;
+static int aioPending = 0;         // Jobs submitted and not completed
+static int aioBackend = 0;         // OUT_SYNC, OUT_THREAD or OUT_URING
+
+// Write a whole file at once
+static void aioWriteFile(AioJob* j) {
+  int fd = open(j->filename, O_WRONLY | O_CREAT | O_CLOEXEC | (j->append ? O_APPEND : O_TRUNC), 0666);
+  if (fd < 0 || !writeAll(fd, j->data, j->used) || close(fd)) {
+    fprintf(stderr, "Trouble writing: %s\n", j->filename);
+    exit(NOT_WRITEABLE);
+  }
+}
+
+
+/* Writer thread */
+
+static pthread_t aioThread;
+static pthread_mutex_t aioLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aioWork = PTHREAD_COND_INITIALIZER;  // A file queued
+static pthread_cond_t aioDone = PTHREAD_COND_INITIALIZER;  // A file written
+static int aioQueue[AIO_MAX_JOBS]; // Ring of files waiting to be written
+static int aioQueueHead = 0, aioQueueLen = 0;
+
+static void* aioWriter(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&aioLock);
+  while (1) {
+    while (aioQueueLen == 0) pthread_cond_wait(&aioWork, &aioLock);
+    int k = aioQueue[aioQueueHead];
+    aioQueueHead = (aioQueueHead + 1) % AIO_MAX_JOBS;
+    aioQueueLen--;
+    pthread_mutex_unlock(&aioLock);
+    aioWriteFile(&aioJobs[k]);
+    pthread_mutex_lock(&aioLock);
+    aioFree[aioNumFree++] = k;
+    aioPending--;
+    pthread_cond_broadcast(&aioDone);
+  }
+  return NULL;
+}
+
+
+/* io_uring, through its system calls */
+
+static int aioRing = -1;
+static struct io_uring_sqe* aioSqes;
+static uint32_t *aioSqTail, *aioSqMask, *aioSqArray;
+static uint32_t *aioCqHead, *aioCqTail, *aioCqMask;
+static struct io_uring_cqe* aioCqes;
+static uint32_t aioSqLocal;        // Tail of the requests not yet submitted
+static uint32_t aioToSubmit = 0;
+
+// user_data of a request: job, operation and chunk number
+#define AIO_OPEN  1
+#define AIO_WRITE 2
+#define AIO_CLOSE 3
+#define AIO_DATA(job, op, k) (((uint64_t)(k) << 16) | ((op) << 8) | (job))
+
+static int aioEnter(uint32_t submit, uint32_t wait) {
+  int r;
+  do {
+    r = syscall(__NR_io_uring_enter, aioRing, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  return r;
+}
+
+static struct io_uring_sqe* aioSqe(uint8_t op, uint8_t flags, uint64_t data) {
+  uint32_t i = aioSqLocal & *aioSqMask;
+  struct io_uring_sqe* s = &aioSqes[i];
+  memset(s, 0, sizeof(*s));
+  s->opcode = op;
+  s->flags = flags;
+  s->user_data = data;
+  aioSqArray[i] = i;
+  aioSqLocal++;
+  aioToSubmit++;
+  return s;
+}
+
+// Queue the chain open/write.../close of job k, using the fixed file slot k
+static void aioChain(int k) {
+  AioJob* j = &aioJobs[k];
+  struct io_uring_sqe* s = aioSqe(IORING_OP_OPENAT, IOSQE_IO_LINK | (j->append ? IOSQE_IO_DRAIN : 0),
+                                  AIO_DATA(k, AIO_OPEN, 0));
+  s->fd = AT_FDCWD;
+  s->addr = (uint64_t)(uintptr_t)j->filename;
+  s->len = 0666;
+  s->open_flags = O_WRONLY | O_CREAT | (j->append ? O_APPEND : O_TRUNC);
+  s->file_index = k + 1;
+  for (size_t off = 0; off < j->used; off += AIO_CHUNK) {
+    s = aioSqe(IORING_OP_WRITE, IOSQE_FIXED_FILE | IOSQE_IO_LINK, AIO_DATA(k, AIO_WRITE, off / AIO_CHUNK));
+    s->fd = k;
+    s->addr = (uint64_t)(uintptr_t)(j->data + off);
+    s->len = j->used - off < AIO_CHUNK ? j->used - off : AIO_CHUNK;
+    s->off = j->append ? (uint64_t)-1 : off;
+  }
+  s = aioSqe(IORING_OP_CLOSE, 0, AIO_DATA(k, AIO_CLOSE, 0));
+  s->file_index = k + 1;
+  __atomic_store_n(aioSqTail, aioSqLocal, __ATOMIC_RELEASE);
+}
+
+// Handle the completions available; return the number of files completed
+static int aioReap() {
+  int n = 0;
+  uint32_t head = *aioCqHead;
+  uint32_t tail = __atomic_load_n(aioCqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* c = &aioCqes[head & *aioCqMask];
+    int k = c->user_data & 0xff;
+    int op = (c->user_data >> 8) & 0xff;
+    size_t off = (c->user_data >> 16) * (size_t)AIO_CHUNK;
+    AioJob* j = &aioJobs[k];
+    size_t len = j->used - off < AIO_CHUNK ? j->used - off : AIO_CHUNK;
+    if (c->res < 0 || (op == AIO_WRITE && (size_t)c->res != len)) {
+      fprintf(stderr, "Trouble writing: %s\n", j->filename);
+      exit(NOT_WRITEABLE);
+    }
+    if (op == AIO_CLOSE) {
+      aioFree[aioNumFree++] = k;
+      aioPending--;
+      n++;
+    }
+  }
+  __atomic_store_n(aioCqHead, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+// Set up the ring, with one fixed file slot per job; return 0 if it fails
+static int aioInitUring() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = AIO_CQ_ENTRIES;
+  aioRing = syscall(__NR_io_uring_setup, AIO_SQ_ENTRIES, &p);
+  if (aioRing < 0) return 0;
+
+  size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  uint8_t* sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aioRing, IORING_OFF_SQ_RING);
+  uint8_t* cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aioRing, IORING_OFF_CQ_RING);
+  aioSqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, aioRing, IORING_OFF_SQES);
+  int slots[AIO_MAX_JOBS];
+  memset(slots, -1, sizeof(slots));
+  if (sq == MAP_FAILED || cq == MAP_FAILED || aioSqes == MAP_FAILED
+  || syscall(__NR_io_uring_register, aioRing, IORING_REGISTER_FILES, slots, AIO_MAX_JOBS) < 0) {
+    close(aioRing);
+    return 0;
+  }
+  aioSqTail = (uint32_t*)(sq + p.sq_off.tail);
+  aioSqMask = (uint32_t*)(sq + p.sq_off.ring_mask);
+  aioSqArray = (uint32_t*)(sq + p.sq_off.array);
+  aioCqHead = (uint32_t*)(cq + p.cq_off.head);
+  aioCqTail = (uint32_t*)(cq + p.cq_off.tail);
+  aioCqMask = (uint32_t*)(cq + p.cq_off.ring_mask);
+  aioCqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  aioSqLocal = *aioSqTail;
+
+  // Opening into a fixed file slot needs Linux 5.15; try it with /dev/null
+  AioJob* j = &aioJobs[0];
+  strcpy(j->filename, "/dev/null");
+  j->append = 0;
+  j->used = 0;
+  aioPending++;
+  aioChain(0);
+  if (aioEnter(aioToSubmit, 0) < 0) {
+    close(aioRing);
+    return 0;
+  }
+  aioToSubmit = 0;
+  while (aioPending > 0) {
+    uint32_t tail = __atomic_load_n(aioCqTail, __ATOMIC_ACQUIRE);
+    if (tail == *aioCqHead) {
+      aioEnter(0, 1);
+      continue;
+    }
+    struct io_uring_cqe* c = &aioCqes[*aioCqHead & *aioCqMask];
+    if (c->res < 0) {
+      close(aioRing);
+      aioPending = 0;
+      return 0;
+    }
+    if (((c->user_data >> 8) & 0xff) == AIO_CLOSE) aioPending--;
+    __atomic_store_n(aioCqHead, *aioCqHead + 1, __ATOMIC_RELEASE);
+  }
+  return 1;
+}
+
+
+/* Interface used by ivm_io.h */
+
+static ssize_t aioCookieWrite(void* cookie, const char* buf, size_t size) {
+  AioJob* j = cookie;
+  if (j->used + size > j->size) {
+    j->size = j->used + size > 2 * j->size ? j->used + size : 2 * j->size;
+    j->data = realloc(j->data, j->size);
+    if (!j->data) exit(OUT_OF_MEMORY);
+  }
+  memcpy(j->data + j->used, buf, size);
+  j->used += size;
+  return size;
+}
+
+// The file is complete: hand it to the backend
+static int aioCookieClose(void* cookie) {
+  int k = (AioJob*)cookie - aioJobs;
+  if (aioBackend == OUT_THREAD) {
+    pthread_mutex_lock(&aioLock);
+    aioQueue[(aioQueueHead + aioQueueLen) % AIO_MAX_JOBS] = k;
+    aioQueueLen++;
+    pthread_cond_signal(&aioWork);
+    pthread_mutex_unlock(&aioLock);
+    return 0;
+  }
+  if ((aioJobs[k].used + AIO_CHUNK - 1) / AIO_CHUNK > AIO_MAX_CHAIN) {
+    aioWriteFile(&aioJobs[k]);
+    aioFree[aioNumFree++] = k;
+    aioPending--;
+    return 0;
+  }
+  aioChain(k); // Always room: the entries are consumed when submitted
+  if (aioEnter(aioToSubmit, 0) < 0) {
+    fprintf(stderr, "Trouble writing: %s\n", aioJobs[k].filename);
+    exit(NOT_WRITEABLE);
+  }
+  aioToSubmit = 0;
+  aioReap();
+  return 0;
+}
+
+static void ioInitAsync() {
+  aioBackend = opt_out_backend;
+  if (aioBackend == OUT_SYNC) return;
+  for (int k = 0; k < AIO_MAX_JOBS; k++) aioFree[aioNumFree++] = AIO_MAX_JOBS - 1 - k;
+  if (aioBackend == OUT_URING && !aioInitUring()) {
+    fprintf(stderr, "io_uring not available, output written by a thread\n");
+    aioBackend = OUT_THREAD;
+  }
+  if (aioBackend == OUT_THREAD && pthread_create(&aioThread, NULL, aioWriter, NULL)) {
+    aioBackend = OUT_SYNC;
+  }
+}
+
+// Wait until all the files handed to the backend are written
+static void ioWaitAsync() {
+  if (aioBackend == OUT_THREAD) {
+    pthread_mutex_lock(&aioLock);
+    while (aioPending > 0) pthread_cond_wait(&aioDone, &aioLock);
+    pthread_mutex_unlock(&aioLock);
+  } else if (aioBackend == OUT_URING) {
+    while (aioPending > 0) {
+      if (aioReap() == 0) aioEnter(0, 1);
+    }
+  }
+}
+
+// Open an output file ("wb", or "ab" if append)
+static FILE* ioOutOpen(char* filename, int append) {
+  if (aioBackend == OUT_SYNC) {
+    return fopen(filename, append ? "ab" : "wb");
+  }
+  // Take a free buffer, waiting for a file to be written if there is none
+  if (aioBackend == OUT_THREAD) {
+    pthread_mutex_lock(&aioLock);
+    while (aioNumFree == 0) pthread_cond_wait(&aioDone, &aioLock);
+  } else {
+    while (aioNumFree == 0) {
+      if (aioReap() == 0) aioEnter(0, 1);
+    }
+  }
+  AioJob* j = &aioJobs[aioFree[--aioNumFree]];
+  aioPending++;
+  if (aioBackend == OUT_THREAD) pthread_mutex_unlock(&aioLock);
+
+  if (strlen(filename) >= MAX_FILENAME) exit(STRING_TOO_LONG);
+  strcpy(j->filename, filename);
+  j->append = append;
+  j->used = 0;
+  cookie_io_functions_t io = {NULL, aioCookieWrite, NULL, aioCookieClose};
+  FILE* f = fopencookie(j, "w", io);
+  if (f) setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
+
+#else
+
+static void ioInitAsync() {}
+static void ioWaitAsync() {}
+static FILE* ioOutOpen(char* filename, int append) {
+  return fopen(filename, append ? "ab" : "wb");
+}
+
+#endif // PARALLEL_OUTPUT
+
+#endif //__IVM_IO_ASYNC_H
@@ -0,0 +1,167 @@
+/*
+ Preservation Virtual Machine Project
+
+ Yet another ivm emulator
+
+ Pixel conversion kernels of the frame I/O:
+   - RGB or RGBA (alpha stripped) to gray, for the input frames
+   - gray+alpha to gray, for the input frames
+   - PNG filter Sub of a row, for the builtin PNG encoder
+ RGB/RGBA to gray and the Sub filter have AVX2 and SSE4.1 versions,
+ chosen at run time by ioInitSimd() from what the CPU supports, and a
+ scalar fallback (used as well for the last pixels of a row, on other
+ architectures, and when the environment variable IVM_EMU_NO_SIMD is set)
+
+ The gray conversion is that of libpng's png_set_rgb_to_gray() with
+ its default weights (truncated, not rounded), so a frame converted
+ here has the same pixels as when converted by libpng
+
+ Include it from ivm_io.h
+*/
+
+#ifndef __IVM_IO_SIMD_H
+#define __IVM_IO_SIMD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Weights of red, green and blue (sum 32768)
+#define GRAY_R 6968
+#define GRAY_G 23434
+#define GRAY_B 2366
+
+static void rgbToGrayScalar(uint8_t* dst, const uint8_t* src, size_t n, int channels) {
+  for (size_t k = 0; k < n; k++, src += channels) {
+    dst[k] = (GRAY_R * src[0] + GRAY_G * src[1] + GRAY_B * src[2]) >> 15;
+  }
+}
+
+static void gaToGray(uint8_t* dst, const uint8_t* src, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    dst[k] = src[2*k];
+  }
+}
+
+// Filter Sub of a row of RGB pixels (without the filter type byte)
+static void pngSubScalar(uint8_t* r, const uint8_t* p, size_t rowbytes) {
+  for (size_t i = 0; i < rowbytes && i < 3; i++) r[i] = p[i];
+  for (size_t i = 3; i < rowbytes; i++) r[i] = p[i] - p[i-3];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+  4 pixels (8 with AVX2) per step: the bytes of red and green are spread
+  into 16-bit pairs and blue alone, multiplied and added by pmaddwd into
+  32-bit sums, shifted and packed back to bytes
+*/
+#define RGB_SHUFFLES(channels, rg, b) do { \
+    if ((channels) == 3) { \
+      rg = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1); \
+      b  = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1); \
+    } else { \
+      rg = _mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1); \
+      b  = _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1); \
+    } \
+  } while (0)
+
+__attribute__((target("sse4.1")))
+static void rgbToGraySse(uint8_t* dst, const uint8_t* src, size_t n, int channels) {
+  const __m128i wrg = _mm_set1_epi32(GRAY_G << 16 | GRAY_R);
+  const __m128i wb = _mm_set1_epi32(GRAY_B);
+  __m128i srg, sb;
+  RGB_SHUFFLES(channels, srg, sb);
+  size_t last = channels == 3 ? 6 : 4; // Pixels needed to load 16 bytes
+  size_t k = 0;
+  for (; k + last <= n; k += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + k * channels));
+    __m128i s = _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(v, srg), wrg),
+                              _mm_madd_epi16(_mm_shuffle_epi8(v, sb), wb));
+    s = _mm_srli_epi32(s, 15);
+    s = _mm_packus_epi16(_mm_packus_epi32(s, s), s);
+    uint32_t g = _mm_cvtsi128_si32(s);
+    memcpy(dst + k, &g, 4);
+  }
+  rgbToGrayScalar(dst + k, src + k * channels, n - k, channels);
+}
+
+__attribute__((target("avx2")))
+static void rgbToGrayAvx2(uint8_t* dst, const uint8_t* src, size_t n, int channels) {
+  const __m256i wrg = _mm256_set1_epi32(GRAY_G << 16 | GRAY_R);
+  const __m256i wb = _mm256_set1_epi32(GRAY_B);
+  __m128i srg128, sb128;
+  RGB_SHUFFLES(channels, srg128, sb128);
+  const __m256i srg = _mm256_broadcastsi128_si256(srg128);
+  const __m256i sb = _mm256_broadcastsi128_si256(sb128);
+  size_t last = channels == 3 ? 10 : 8;
+  size_t k = 0;
+  for (; k + last <= n; k += 8) {
+    const uint8_t* p = src + k * channels;
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                        _mm_loadu_si128((const __m128i*)(p + 4 * channels)), 1);
+    __m256i s = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(v, srg), wrg),
+                                 _mm256_madd_epi16(_mm256_shuffle_epi8(v, sb), wb));
+    s = _mm256_srli_epi32(s, 15);
+    s = _mm256_packus_epi16(_mm256_packus_epi32(s, s), s); // 4 gray bytes at the start of each lane
+    uint32_t g[2] = {_mm_cvtsi128_si32(_mm256_castsi256_si128(s)),
+                     _mm_cvtsi128_si32(_mm256_extracti128_si256(s, 1))};
+    memcpy(dst + k, g, 8);
+  }
+  rgbToGrayScalar(dst + k, src + k * channels, n - k, channels);
+}
+
+__attribute__((target("sse4.1")))
+static void pngSubSse(uint8_t* r, const uint8_t* p, size_t rowbytes) {
+  size_t i = 3;
+  if (rowbytes < 3 + 16) {
+    pngSubScalar(r, p, rowbytes);
+    return;
+  }
+  memcpy(r, p, 3);
+  for (; i + 16 <= rowbytes; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + i - 3));
+    _mm_storeu_si128((__m128i*)(r + i), _mm_sub_epi8(a, b));
+  }
+  for (; i < rowbytes; i++) r[i] = p[i] - p[i-3];
+}
+
+__attribute__((target("avx2")))
+static void pngSubAvx2(uint8_t* r, const uint8_t* p, size_t rowbytes) {
+  size_t i = 3;
+  if (rowbytes < 3 + 32) {
+    pngSubScalar(r, p, rowbytes);
+    return;
+  }
+  memcpy(r, p, 3);
+  for (; i + 32 <= rowbytes; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(p + i - 3));
+    _mm256_storeu_si256((__m256i*)(r + i), _mm256_sub_epi8(a, b));
+  }
+  for (; i < rowbytes; i++) r[i] = p[i] - p[i-3];
+}
+#endif
+
+// Kernels in use (scalar until ioInitSimd() is called)
+static void (*rgbToGray)(uint8_t* dst, const uint8_t* src, size_t n, int channels) = rgbToGrayScalar;
+static void (*pngSub)(uint8_t* r, const uint8_t* p, size_t rowbytes) = pngSubScalar;
+
+// Choose the kernels for this CPU (call it before starting the I/O threads)
+static void ioInitSimd() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (getenv("IVM_EMU_NO_SIMD")) return;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    rgbToGray = rgbToGrayAvx2;
+    pngSub = pngSubAvx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    rgbToGray = rgbToGraySse;
+    pngSub = pngSubSse;
+  }
+#endif
+}
+
+#endif //__IVM_IO_SIMD_H
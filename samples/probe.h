@@ -1,6 +1,19 @@
 #ifndef _PROBE_H_
 #define _PROBE_H_
 
+// Descriptor of ivm64_blit()
+typedef struct {
+    unsigned long x, y, w, h;
+    const void *src;
+    unsigned long stride;
+} ivm64_blit_t;
+
+// Descriptor of ivm64_read_rows()
+typedef struct {
+    void *dst;
+    unsigned long stride, first_row, nrows;
+} ivm64_read_rows_t;
+
 // include this header, define WITH_IVM64_PROBES
 #ifdef WITH_IVM64_PROBES
 
@@ -22,15 +35,35 @@
 
 #define ivm64_read_probe(n,a) do{__asm__ volatile ("push!! %0 (load1 %1)\n\tdata1 [ 0xf3 ]":"=m"(a):"m"(n));}while(0)
 
+// if the emulator runs with --snapshot <file>
+//   write the full emulator state to <file> (resume with --restore <file>)
+// else do nothing
+#define ivm64_snapshot()    __asm__ volatile ("data1 [ 0xf4 ]")
+
+// copy a w x h rectangle of packed RGB (3 bytes per pixel, rows 'stride'
+// bytes apart) from 'src' to position (x, y) of the current output frame,
+// as w*h set_pixel instructions would do (clipped to the frame)
+#define ivm64_blit(d)       __asm__ volatile ("push!! %0\n\tdata1 [ 0xf5 ]"::"m"(d):"memory")
+
+// copy rows first_row .. first_row+nrows-1 of the last input frame read
+// (one gray byte per pixel, 'width' bytes per row) to 'dst', rows 'stride'
+// bytes apart, as read_pixel instructions would do (clipped to the frame)
+#define ivm64_read_rows(d)  __asm__ volatile ("push!! %0\n\tdata1 [ 0xf6 ]"::"m"(d):"memory")
+
 
 #else
-// Do not produce opcodes 0xf0, 0xf1, 0xf2
+// Do not produce opcodes 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6
+// (without them, ivm64_blit() and ivm64_read_rows() do nothing:
+//  keep a set_pixel/read_pixel path)
 #define ivm64_break_point()
 #define ivm64_trace_off()
 #define ivm64_trace_soft()
 #define ivm64_trace_hard()
 #define ivm64_set_probe(n)
 #define ivm64_read_probe(n,a)
+#define ivm64_snapshot()
+#define ivm64_blit(d)
+#define ivm64_read_rows(d)
 
 #endif
 